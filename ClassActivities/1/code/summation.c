@@ -1,23 +1,77 @@
 // Spencer Presley
-// This program uses non-blocking sends and receives to calculate the sum of an array of numbers
-// It distributes the work among process equally by calculating the number of elements each process will handle and accounting for any remainder that may occur causing an uneven distribution
-// The program then calculates the local sum of the elements in the local array and sends the result to the root process
-// The root process receives the sums from the other processes and adds them to the total sum
-// Finally, the program prints the total sum
+// This program calculates the sum of the numbers 1 through n across all processes
+// It distributes the work among process equally by calculating the range of elements each process will handle and accounting for any remainder that may occur causing an uneven distribution
+// Every process produces the elements of its own range locally, so nothing but the partial sums is ever sent and no process (rank 0 included) holds an array
+// The partial sums are combined on rank 0 with MPI_Reduce and a custom operation, with a hand-written binomial tree of sends and receives,
+// or one-sidedly with MPI_Put into a window on rank 0, so rank 0 never has to post a matching receive
+// Finally, rank 0 prints the total sum
 // There are also prints to show what is happening to make it more clear, rather than only relying on the reading of the logic
+// When built with -fopenmp (mpicc -fopenmp summation.c -o summation) each process also splits its local sum across OMP_NUM_THREADS threads,
+// so the program can run as one process per node or socket instead of one per core
+// Rank 0 prints the time from the first barrier until it has the total, measured with MPI_Wtime, as "Elapsed time: <seconds> seconds"
+//
+// Usage: mpirun -np <p> ./summation <n> [--data=int|double] [--reduce=mpi|tree|rma]
+//
+//     --data=int       Sum the integers 1 through n (default). n can be as large as 10^10, whose sum (about 5 * 10^19) does
+//                      not fit in 64 bits, so the sums are kept as 128-bit integers made of two 64-bit words
+//     --data=double    Sum the floating-point values 1/1 + 1/2 + ... + 1/n instead, with Kahan-Babuska (Neumaier) compensated
+//                      summation so the millions of tiny terms at the end are not lost against the large running total
+//     --reduce=mpi     Combine the partial sums with MPI_Reduce and a custom MPI_Op (default)
+//     --reduce=tree    Combine them with a binomial tree: in step k every process whose rank has bit k set sends its partial sum to
+//                      the process 2^k below it and drops out, so rank 0 has the total after log2(p) steps
+//     --reduce=rma     Every process puts its partial sum into its own slot of a window on rank 0 under a passive-target lock and
+//                      then adds 1 to an arrival counter in the same window, rank 0 sums its own range meanwhile and then waits for
+//                      the counter to reach p - 1 and combines the slots in rank order
 
 #include <stdio.h>
 #include <mpi.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Largest n accepted, 10^10
+#define MAX_ELEMENTS 10000000000LL
+
+// Elements summed into a plain 64-bit word before it is added to the 128-bit sum
+// A block of 2^20 elements of at most 10^10 adds up to about 10^16, far below the 64-bit limit of about 1.8 * 10^19
+#define BLOCK_ELEMENTS (1 << 20)
+
+enum DataType {
+    DATA_INT,
+    DATA_DOUBLE
+};
+
+enum ReduceMethod {
+    REDUCE_MPI,
+    REDUCE_TREE,
+    REDUCE_RMA
+};
+
+// An unsigned 128-bit integer as two 64-bit words, so it can be sent as two MPI_UINT64_T
+struct Sum128 {
+    uint64_t low;
+    uint64_t high;
+};
+
+// A compensated floating-point sum: the true value is sum + compensation
+struct CompensatedSum {
+    double sum;
+    double compensation;
+};
 
 // Function to calculate start and count for each process
-void calculate_start_and_count(int rank, int size, int n, int *start, int *count) {
+void calculate_start_and_count(int rank, int size, long long n, long long *start, long long *count) {
     // Elements_per_process is the base number of elements each process will handle
     // It is calculated by dividing the total number of elements by the number of processes
-    int elements_per_process = n / size;
+    long long elements_per_process = n / size;
     // Remainder is the number of elements that need to be distributed among the first 'remainder' processes
     // It is calculated by getting the remainder of the total number of elements divided by the number of processes
-    int remainder = n % size;
+    long long remainder = n % size;
     // The start is calculated by multiplying the rank by the number of elements each process will handle and adding the rank if the rank is less than the remainder
     // This ensures that the first 'remainder' processes will have 1 more element than the others
     // If the rank is greater than the remainder, then the start is the base number of elements each process will handle times the remainder plus the rank otherwise it is the base number of elements each process will handle times the rank plus the remainder
@@ -28,36 +82,310 @@ void calculate_start_and_count(int rank, int size, int n, int *start, int *count
     *count = elements_per_process + (rank < remainder ? 1 : 0);
 }
 
-int main(int argc, char **argv) {
-    // Ensure the correct number of arguments, it should be only 2, the program name and the number n in which to sum from 1 to n
-    if (argc != 2) {
-        // If the number of arguments is not 2, print an error message and exit with code 1
-        fprintf(stderr, "Usage: %s <number_of_elements>\n", argv[0]);
-        return 1;
+// Adds a 64-bit value to a 128-bit sum, a carry out of the low word goes into the high word
+void add_u64(struct Sum128 *sum, uint64_t value) {
+    sum->low += value;
+    if (sum->low < value) {
+        sum->high++;
+    }
+}
+
+void add_sum128(struct Sum128 *sum, const struct Sum128 *value) {
+    add_u64(sum, value->low);
+    sum->high += value->high;
+}
+
+// The full 128-bit product of two 64-bit values, built from four 32 x 32 bit products
+struct Sum128 multiply_u64(uint64_t a, uint64_t b) {
+    uint64_t a_low = a & 0xffffffffULL, a_high = a >> 32;
+    uint64_t b_low = b & 0xffffffffULL, b_high = b >> 32;
+    uint64_t low_low = a_low * b_low;
+    uint64_t low_high = a_low * b_high;
+    uint64_t high_low = a_high * b_low;
+    uint64_t high_high = a_high * b_high;
+
+    struct Sum128 product = {low_low, high_high};
+    add_u64(&product, low_high << 32);
+    product.high += low_high >> 32;
+    add_u64(&product, high_low << 32);
+    product.high += high_low >> 32;
+    return product;
+}
+
+// Writes the decimal digits of a 128-bit value into text, which needs room for 40 characters
+void format_sum128(struct Sum128 value, char *text) {
+    // The value as four 32-bit limbs, most significant first, divided by 10 once per digit
+    uint32_t limbs[4] = {(uint32_t)(value.high >> 32), (uint32_t)value.high, (uint32_t)(value.low >> 32), (uint32_t)value.low};
+    char digits[40];
+    int digit_count = 0;
+    do {
+        uint64_t remainder = 0;
+        int nonzero = 0;
+        for (int i = 0; i < 4; i++) {
+            uint64_t current = (remainder << 32) | limbs[i];
+            limbs[i] = (uint32_t)(current / 10);
+            remainder = current % 10;
+            nonzero |= limbs[i] != 0;
+        }
+        digits[digit_count++] = (char)('0' + remainder);
+        if (!nonzero) {
+            break;
+        }
+    } while (1);
+
+    for (int i = 0; i < digit_count; i++) {
+        text[i] = digits[digit_count - 1 - i];
+    }
+    text[digit_count] = '\0';
+}
+
+// Adds value to a compensated sum, the rounding error of the addition is kept in the compensation (Neumaier's variant of Kahan summation)
+void add_compensated(struct CompensatedSum *sum, double value) {
+    double total = sum->sum + value;
+    if (fabs(sum->sum) >= fabs(value)) {
+        sum->compensation += (sum->sum - total) + value;
+    } else {
+        sum->compensation += (value - total) + sum->sum;
+    }
+    sum->sum = total;
+}
+
+void add_compensated_sum(struct CompensatedSum *sum, const struct CompensatedSum *value) {
+    add_compensated(sum, value->sum);
+    sum->compensation += value->compensation;
+}
+
+// The operations handed to MPI_Op_create, they combine in and inout element by element
+void sum128_op(void *in, void *inout, int *len, MPI_Datatype *datatype) {
+    (void)datatype;
+    for (int i = 0; i < *len; i++) {
+        add_sum128(&((struct Sum128 *)inout)[i], &((struct Sum128 *)in)[i]);
+    }
+}
+
+void compensated_sum_op(void *in, void *inout, int *len, MPI_Datatype *datatype) {
+    (void)datatype;
+    for (int i = 0; i < *len; i++) {
+        add_compensated_sum(&((struct CompensatedSum *)inout)[i], &((struct CompensatedSum *)in)[i]);
+    }
+}
+
+// Sum of the elements start + 1 through start + count, produced on the fly
+// Each thread sums its share of whole blocks into its own 128-bit sum and the thread sums are added at the end
+struct Sum128 sum_int_range(long long start, long long count) {
+    struct Sum128 local_sum = {0, 0};
+    long long blocks = (count + BLOCK_ELEMENTS - 1) / BLOCK_ELEMENTS;
+
+    #pragma omp parallel
+    {
+        struct Sum128 thread_sum = {0, 0};
+        #pragma omp for schedule(static)
+        for (long long block = 0; block < blocks; block++) {
+            long long first = start + block * BLOCK_ELEMENTS;
+            long long last = first + BLOCK_ELEMENTS < start + count ? first + BLOCK_ELEMENTS : start + count;
+            uint64_t block_sum = 0;
+            // Element i (counting from 0) is the number i + 1
+            for (long long i = first; i < last; i++) {
+                block_sum += (uint64_t)(i + 1);
+            }
+            add_u64(&thread_sum, block_sum);
+        }
+        #pragma omp critical
+        add_sum128(&local_sum, &thread_sum);
     }
+    return local_sum;
+}
 
-    // Convert the argument to an integer
-    int n = atoi(argv[1]);
+// Compensated sum of 1/(start + 1) through 1/(start + count)
+// Each block gets its own compensated sum and the blocks are added in order, so the result does not depend on the thread count
+struct CompensatedSum sum_double_range(long long start, long long count) {
+    struct CompensatedSum local_sum = {0.0, 0.0};
+    long long blocks = (count + BLOCK_ELEMENTS - 1) / BLOCK_ELEMENTS;
 
+    #pragma omp parallel for ordered schedule(static, 1)
+    for (long long block = 0; block < blocks; block++) {
+        long long first = start + block * BLOCK_ELEMENTS;
+        long long last = first + BLOCK_ELEMENTS < start + count ? first + BLOCK_ELEMENTS : start + count;
+        struct CompensatedSum block_sum = {0.0, 0.0};
+        // Element i (counting from 0) is 1 / (i + 1), summed from the small end so the terms are added in increasing size
+        for (long long i = last - 1; i >= first; i--) {
+            add_compensated(&block_sum, 1.0 / (double)(i + 1));
+        }
+        #pragma omp ordered
+        add_compensated_sum(&local_sum, &block_sum);
+    }
+    return local_sum;
+}
+
+/*
+Binomial tree reduction to rank 0.
+- In step k (k = 1, 2, 4, ...) a process whose rank has bit k set sends its partial sum to rank - k and is done
+- A process without that bit receives from rank + k, if that process exists, and combines it into its own partial sum
+- Example with 8 processes:
+    - step 1: 1 -> 0, 3 -> 2, 5 -> 4, 7 -> 6
+    - step 2: 2 -> 0, 6 -> 4
+    - step 4: 4 -> 0
+- Rank 0 receives log2(p) messages instead of p - 1 and all messages of a step travel at the same time
+*/
+void tree_reduce(void *value, void *received, MPI_Datatype datatype, MPI_User_function *combine, int rank, int size) {
+    int one = 1;
+    for (int step = 1; step < size; step *= 2) {
+        if (rank & step) {
+            MPI_Send(value, 1, datatype, rank - step, 0, MPI_COMM_WORLD);
+            return;
+        }
+        if (rank + step < size) {
+            MPI_Recv(received, 1, datatype, rank + step, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            combine(received, value, &one, &datatype);
+        }
+    }
+}
+
+/*
+Window for --reduce=rma, created before the clock starts so setting it up is not part of the timed collection
+- Rank 0 exposes one slot of value_bytes per process followed by a long long arrival counter, the other processes expose nothing
+- Every process opens a passive-target epoch on rank 0 for the whole run, rank 0 only polls the counter and never matches anything
+*/
+MPI_Win create_sum_window(size_t value_bytes, int rank, int size, void **slots) {
+    MPI_Aint window_bytes = rank == 0 ? (MPI_Aint)(value_bytes * size + sizeof(long long)) : 0;
+    MPI_Win window;
+    MPI_Win_allocate(window_bytes, 1, MPI_INFO_NULL, MPI_COMM_WORLD, slots, &window);
+    if (rank == 0) {
+        memset(*slots, 0, (size_t)window_bytes);
+    }
+    // The counter must be zero before anyone can add to it
+    MPI_Barrier(MPI_COMM_WORLD);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, window);
+    return window;
+}
+
+/*
+One-sided reduction to rank 0
+- Process r puts its value into slot r, flushes so the value is at rank 0 before the counter changes, and adds 1 to the counter
+- Rank 0 reads the counter with MPI_Fetch_and_op(MPI_NO_OP), which is atomic with respect to the additions, until all p - 1 arrived
+- The slots are then combined in rank order, so the double sum is the same on every run
+*/
+void rma_reduce(void *value, void *slots, size_t value_bytes, MPI_Datatype datatype, MPI_User_function *combine, MPI_Win window, int rank, int size) {
+    MPI_Aint counter_offset = (MPI_Aint)(value_bytes * size);
+    long long one = 1, arrived = 0;
+    if (rank != 0) {
+        MPI_Put(value, 1, datatype, 0, (MPI_Aint)(value_bytes * rank), 1, datatype, window);
+        MPI_Win_flush(0, window);
+        MPI_Accumulate(&one, 1, MPI_LONG_LONG, 0, counter_offset, 1, MPI_LONG_LONG, MPI_SUM, window);
+        MPI_Win_flush(0, window);
+        return;
+    }
+    while (arrived < size - 1) {
+        MPI_Fetch_and_op(NULL, &arrived, MPI_LONG_LONG, 0, counter_offset, MPI_NO_OP, window);
+        MPI_Win_flush(0, window);
+    }
+    // Make the values put by the other processes visible to rank 0's own loads
+    MPI_Win_sync(window);
+    int one_element = 1;
+    for (int r = 1; r < size; r++) {
+        combine((char *)slots + value_bytes * r, value, &one_element, &datatype);
+    }
+}
+
+// Combines every process's value into value on rank 0, with MPI_Reduce, the binomial tree or the window
+// received is scratch space of value_bytes, the size of one element of datatype
+void reduce_to_root(void *value, void *received, size_t value_bytes, MPI_Datatype datatype, MPI_User_function *combine, enum ReduceMethod method, MPI_Win window, void *slots, int rank, int size) {
+    if (method == REDUCE_TREE) {
+        tree_reduce(value, received, datatype, combine, rank, size);
+        return;
+    }
+    if (method == REDUCE_RMA) {
+        rma_reduce(value, slots, value_bytes, datatype, combine, window, rank, size);
+        return;
+    }
+    MPI_Op op;
+    MPI_Op_create(combine, 1, &op);
+    MPI_Reduce(value, received, 1, datatype, op, 0, MPI_COMM_WORLD);
+    MPI_Op_free(&op);
+    if (rank == 0) {
+        memcpy(value, received, value_bytes);
+    }
+}
+
+int main(int argc, char **argv) {
     /*
     Initialize the MPI environment
     - Get the rank of the process and the total number of processes
-    - Get the number of elements per process and the remainder
     */
-    int rank, size;
-    MPI_Init(&argc, &argv);
+    int rank, size, provided;
+    // Only the main thread makes MPI calls, the other threads only help with the local sum
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
 
+    // Ensure there is an n, the number in which to sum from 1 to n, followed by any options
+    enum DataType data = DATA_INT;
+    enum ReduceMethod method = REDUCE_MPI;
+    int usage_error = argc < 2;
+    for (int i = 2; i < argc && !usage_error; i++) {
+        if (strcmp(argv[i], "--data=int") == 0) {
+            data = DATA_INT;
+        } else if (strcmp(argv[i], "--data=double") == 0) {
+            data = DATA_DOUBLE;
+        } else if (strcmp(argv[i], "--reduce=mpi") == 0) {
+            method = REDUCE_MPI;
+        } else if (strcmp(argv[i], "--reduce=tree") == 0) {
+            method = REDUCE_TREE;
+        } else if (strcmp(argv[i], "--reduce=rma") == 0) {
+            method = REDUCE_RMA;
+        } else {
+            usage_error = 1;
+        }
+    }
+
+    // Convert the argument to a 64-bit integer
+    long long n = usage_error ? 0 : strtoll(argv[1], NULL, 10);
+    if (usage_error || n < 1 || n > MAX_ELEMENTS) {
+        // If the arguments are not valid, print an error message and exit with code 1
+        if (rank == 0) {
+            fprintf(stderr, "Usage: %s <number_of_elements, 1 to %lld> [--data=int|double] [--reduce=mpi|tree|rma]\n", argv[0], MAX_ELEMENTS);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
+#ifdef _OPENMP
+    // If the MPI library cannot support threads at all, fall back to one thread per process
+    if (provided < MPI_THREAD_FUNNELED) {
+        omp_set_num_threads(1);
+    }
+    if (rank == 0) {
+        printf("Process 0: Using %d threads per process\n", omp_get_max_threads());
+    }
+#else
+    (void)provided;
+#endif
+
+    // The partial sums travel as two 64-bit words, either the two words of a 128-bit integer or a double and its compensation
+    MPI_Datatype sum_type;
+    MPI_Type_contiguous(2, data == DATA_INT ? MPI_UINT64_T : MPI_DOUBLE, &sum_type);
+    MPI_Type_commit(&sum_type);
+
+    // Both kinds of partial sum are 16 bytes
+    MPI_Win window = MPI_WIN_NULL;
+    void *slots = NULL;
+    if (method == REDUCE_RMA) {
+        window = create_sum_window(sizeof(struct Sum128), rank, size, &slots);
+    }
+
+    // Every process starts the clock together so the time covers summation and collection
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start_time = MPI_Wtime();
+
     /*
-    Calculate the number of elements per process and the remainder
+    Calculate the range of elements this process handles
     - The number of elements per process is the total number of elements divided by the number of processes
     - The remainder is the total number of elements modulo the number of processes
         - This does the following:
             - n / size gives the base number of elements each process will handle
             - n % size gives the remainder (the extra elements that need to be distributed)
             - The remainder elements are distributed among the first 'remainder' processes
-        - Example: 
+        - Example:
             - n = 100
             - size = 8
             - elements_per_process = 100 / 8 = 12
@@ -66,123 +394,54 @@ int main(int argc, char **argv) {
                 - First 4 processes will have 13 elements (12 + 1)
                 - Last 4 processes will have 12 elements
         - This approach ensures an even distribution with at most 1 element difference between processes
+    - Every process computes its own range, so rank 0 does not have to send anything
     */
-    int local_start, local_elements;
+    long long local_start, local_elements;
     calculate_start_and_count(rank, size, n, &local_start, &local_elements);
-    int local_end = local_start + local_elements - 1;
-
-    // Initialize the array, requests, and request count
-    int *array = NULL;
-    MPI_Request *requests = NULL;
-    int req_count = 0;
+    long long local_end = local_start + local_elements - 1;
 
-    // If the current process is the root process (rank 0)
-    if (rank == 0) {
-        // Allocate memory for the array
-        array = (int *)malloc(n * sizeof(int));
-        // Fill the array with sequential numbers from 1 to n with an offset of 1
-        for (int i = 0; i < n; i++) {
-            array[i] = i + 1;
-        }
-
-        // Allocate memory for the requests
-        requests = (MPI_Request *)malloc(3 * (size - 1) * sizeof(MPI_Request));
-
-        // Update the sending logic for rank 0
-        for (int i = 1; i < size; i++) {
-            int start, count;
-            calculate_start_and_count(i, size, n, &start, &count);
-            int end = start + count - 1;
-            
-            printf("Process 0: Sending start=%d and end=%d to process %d\n", start, end, i);
-
-            // Send the start and end indices to the current process in a non-blocking fashion
-            MPI_Isend(&start, 1, MPI_INT, i, 0, MPI_COMM_WORLD, &requests[req_count++]);
-            MPI_Isend(&end, 1, MPI_INT, i, 1, MPI_COMM_WORLD, &requests[req_count++]);
-            MPI_Isend(&array[start], count, MPI_INT, i, 2, MPI_COMM_WORLD, &requests[req_count++]);
-        }
+    // Calculate the local sum of the elements in the local range, split across the process's threads when built with OpenMP
+    struct Sum128 int_sum = {0, 0}, int_received;
+    struct CompensatedSum double_sum = {0.0, 0.0}, double_received;
+    if (data == DATA_INT) {
+        int_sum = sum_int_range(local_start, local_elements);
+        char text[40];
+        format_sum128(int_sum, text);
+        printf("Process %d: local_start=%lld, local_end=%lld, local_sum=%s\n", rank, local_start, local_end, text);
+        reduce_to_root(&int_sum, &int_received, sizeof(int_sum), sum_type, sum128_op, method, window, slots, rank, size);
     } else {
-        // Allocate memory for the requests
-        requests = (MPI_Request *)malloc(3 * sizeof(MPI_Request));
-
-        // Receive the start and end indices from the root process in a non-blocking fashion
-        MPI_Irecv(&local_start, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, &requests[req_count++]);
-        MPI_Irecv(&local_end, 1, MPI_INT, 0, 1, MPI_COMM_WORLD, &requests[req_count++]);
-    }
-
-    // Calculate the size of the local array
-    int local_size = local_end - local_start + 1;
-    // Allocate memory for the local array
-    int *local_array = (int *)malloc(local_size * sizeof(int));
-
-    if (rank != 0) {
-        MPI_Irecv(local_array, local_size, MPI_INT, 0, 2, MPI_COMM_WORLD, &requests[req_count++]);
-    }
-
-    // Wait for all the requests to complete
-    MPI_Waitall(req_count, requests, MPI_STATUSES_IGNORE);
-    // Free the memory allocated for the requests
-    free(requests);
-
-    printf("Process %d: Received local_start=%d and local_end=%d\n", rank, local_start, local_end);
-    printf("Process %d: Received array segment of size %d\n", rank, local_size);
-
-    if (rank == 0) {
-        // Copy the elements from the global array to the local array
-        for (int i = 0; i < local_size; i++) {
-            local_array[i] = array[i];
-        }
-    }
-
-    // Calculate the local sum of the elements in the local array
-    int local_sum = 0;
-    for (int i = 0; i < local_size; i++) {
-        local_sum += local_array[i];
+        double_sum = sum_double_range(local_start, local_elements);
+        printf("Process %d: local_start=%lld, local_end=%lld, local_sum=%.17g\n", rank, local_start, local_end, double_sum.sum + double_sum.compensation);
+        reduce_to_root(&double_sum, &double_received, sizeof(double_sum), sum_type, compensated_sum_op, method, window, slots, rank, size);
     }
 
-    printf("Process %d: local_start=%d, local_end=%d, local_sum=%d\n", rank, local_start, local_end, local_sum);
-
     // If the current process is the root process (rank 0)
     if (rank == 0) {
-        // Initialize the total sum to the local sum of the current process
-        int total_sum = local_sum;
-        // Allocate memory for the received sums
-        int *received_sums = (int *)malloc((size - 1) * sizeof(int));
-        // Allocate memory for the requests
-        requests = (MPI_Request *)malloc((size - 1) * sizeof(MPI_Request));
-
-        // Receive the sums from the other processes in a non-blocking fashion
-        for (int i = 1; i < size; i++) {
-            MPI_Irecv(&received_sums[i-1], 1, MPI_INT, i, 3, MPI_COMM_WORLD, &requests[i-1]);
+        double elapsed = MPI_Wtime() - start_time;
+        if (data == DATA_INT) {
+            // Check against n(n + 1) / 2, halving whichever of n and n + 1 is even first so the product is exact
+            uint64_t a = (uint64_t)n, b = (uint64_t)n + 1;
+            struct Sum128 expected = a % 2 == 0 ? multiply_u64(a / 2, b) : multiply_u64(a, b / 2);
+            char text[40], expected_text[40];
+            format_sum128(int_sum, text);
+            format_sum128(expected, expected_text);
+            printf("Total sum: %s\n", text);
+            printf("Expected sum n(n + 1) / 2: %s (%s)\n", expected_text, int_sum.low == expected.low && int_sum.high == expected.high ? "match" : "MISMATCH");
+        } else {
+            // The harmonic number H(n) is about ln(n) + 0.5772156649015329 + 1/(2n) - 1/(12n^2), which is very close for large n
+            double expected = log((double)n) + 0.57721566490153286 + 1.0 / (2.0 * n) - 1.0 / (12.0 * (double)n * n);
+            printf("Total sum: %.17g\n", double_sum.sum + double_sum.compensation);
+            printf("Expected sum ln(n) + gamma + 1/(2n) - 1/(12n^2): %.17g\n", expected);
         }
-
-        // Wait for all the requests to complete
-        MPI_Waitall(size - 1, requests, MPI_STATUSES_IGNORE);
-
-        // Add the received sums to the total sum
-        for (int i = 0; i < size - 1; i++) {
-            total_sum += received_sums[i];
-        }
-
-        printf("Total sum: %d\n", total_sum);
-
-        // Free the memory allocated for the received sums
-        free(received_sums);
-        // Free the memory allocated for the array
-        free(array);
-    } else {
-        // Allocate memory for the request
-        MPI_Request send_request;
-        // Send the sum to the root process in a non-blocking fashion
-        MPI_Isend(&local_sum, 1, MPI_INT, 0, 3, MPI_COMM_WORLD, &send_request);
-        printf("Process %d: Sent sum %d to process 0\n", rank, local_sum);
-        // Wait for the request to complete
-        MPI_Wait(&send_request, MPI_STATUS_IGNORE);
+        printf("Elapsed time: %.9f seconds\n", elapsed);
     }
 
-    // Free the memory allocated for the local array
-    free(local_array);
+    if (window != MPI_WIN_NULL) {
+        MPI_Win_unlock_all(window);
+        MPI_Win_free(&window);
+    }
+    MPI_Type_free(&sum_type);
     // Finalize the MPI environment
     MPI_Finalize();
     return 0;
-}
\ No newline at end of file
+}
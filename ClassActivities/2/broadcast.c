@@ -2,12 +2,268 @@
     Broadcast aka One-to-All mode example
     One process contributes to the results.
     All processes receive the result
+
+    Usage: mpirun -np <p> ./broadcast [bytes] [repetitions] [--algorithm=<a>]
+
+    Without arguments rank 0 broadcasts "Hello World" and every other rank prints it.
+    With a byte count rank 0 broadcasts a payload of that many bytes repetitions times (default 10) with each
+    algorithm (or only the one given with --algorithm). Each repetition starts after a barrier and is timed with
+    MPI_Wtime, rank 0 prints the time of the slowest rank for every repetition. The first repetition is the cold
+    one. After every repetition each rank checks the payload it received.
+
+    Algorithms, all written with point-to-point messages and an arbitrary root:
+
+    linear             The root sends the whole message to every other rank in turn: p - 1 sends at the root
+    binomial           Binomial tree: every rank that has the message sends it on to a rank 2^k away, so the
+                       message reaches everyone in log2(p) steps. Best for short messages, where latency rules
+    scatter-allgather  van de Geijn: the message is cut into p pieces, scattered down a binomial tree and put back
+                       together with a ring allgather. Every rank sends and receives about 2 * bytes instead of
+                       log2(p) * bytes, which wins for long messages
+    chain              Segmented pipeline: the message goes down the chain 0 -> 1 -> ... -> p - 1 in segments of
+                       BCAST_SEGMENT_BYTES, every rank forwards a segment while the next one is arriving. After the
+                       pipeline fills, time is close to bytes / bandwidth whatever p is
+    auto               Picks one of the above from the message size and the rank count
+    mpi                The library's MPI_Bcast, for comparison
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <mpi.h>
 #include <string.h>
+#include <limits.h>
+
+#define DEFAULT_REPETITIONS 10
+
+// Below this auto uses the binomial tree
+#define BCAST_SHORT_BYTES 12288
+// From this size on auto uses the pipelined chain
+#define BCAST_LONG_BYTES (1 << 22)
+// Segment size of the pipelined chain
+#define BCAST_SEGMENT_BYTES (1 << 17)
+
+#define TAG_BCAST 0
+
+enum BroadcastAlgorithm {
+    BCAST_LINEAR,
+    BCAST_BINOMIAL,
+    BCAST_SCATTER_ALLGATHER,
+    BCAST_CHAIN,
+    BCAST_AUTO,
+    BCAST_MPI,
+    BCAST_ALGORITHMS
+};
+
+const char *algorithm_names[BCAST_ALGORITHMS] = {"linear", "binomial", "scatter-allgather", "chain", "auto", "mpi"};
+
+// The root sends the whole message to every other rank in turn
+void linear_broadcast(char *buffer, int bytes, int root, int rank, int size) {
+    if (rank == root) {
+        for (int i = 0; i < size; i++) {
+            if (i != root) {
+                MPI_Send(buffer, bytes, MPI_CHAR, i, TAG_BCAST, MPI_COMM_WORLD);
+            }
+        }
+    } else {
+        MPI_Recv(buffer, bytes, MPI_CHAR, root, TAG_BCAST, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+}
+
+/*
+Binomial tree, in ranks relative to the root.
+- A rank receives from the rank that differs in its lowest set bit (rank 0 has no parent)
+- It then sends to relative + 2^k for every k below that bit, largest first
+- Example with 8 ranks: 0 -> 4, then 0 -> 2 and 4 -> 6, then 0 -> 1, 2 -> 3, 4 -> 5, 6 -> 7
+*/
+void binomial_broadcast(char *buffer, int bytes, int root, int rank, int size) {
+    int relative = (rank - root + size) % size;
+    int mask = 1;
+    while (mask < size) {
+        if (relative & mask) {
+            int parent = (relative - mask + root) % size;
+            MPI_Recv(buffer, bytes, MPI_CHAR, parent, TAG_BCAST, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            break;
+        }
+        mask <<= 1;
+    }
+    for (mask >>= 1; mask > 0; mask >>= 1) {
+        if (relative + mask < size) {
+            MPI_Send(buffer, bytes, MPI_CHAR, (relative + mask + root) % size, TAG_BCAST, MPI_COMM_WORLD);
+        }
+    }
+}
+
+// Bytes of the pieces first_piece through first_piece + pieces - 1 of a message cut into pieces of piece_bytes
+int get_piece_bytes(int bytes, int piece_bytes, int first_piece, int pieces) {
+    long long start = (long long)first_piece * piece_bytes;
+    long long length = (long long)pieces * piece_bytes;
+    if (start >= bytes) {
+        return 0;
+    }
+    return (int)(start + length > bytes ? bytes - start : length);
+}
+
+/*
+van de Geijn broadcast: binomial scatter followed by a ring allgather, in ranks relative to the root.
+- The message is cut into p pieces of ceil(bytes / p), relative rank i ends up owning piece i
+- Scatter: a rank receives from the same parent as in the binomial tree, but only the pieces of the ranks below
+  it in the tree (its own piece up to the piece before relative + mask), and passes each child its share
+- Allgather: in each of p - 1 steps every rank sends the last piece it got to its right neighbour and receives
+  a new one from its left neighbour, so after p - 1 steps every rank has every piece
+*/
+void scatter_allgather_broadcast(char *buffer, int bytes, int root, int rank, int size) {
+    int relative = (rank - root + size) % size;
+    int piece_bytes = (int)(((long long)bytes + size - 1) / size);
+    if (piece_bytes == 0) {
+        return;
+    }
+
+    int mask = 1;
+    while (mask < size) {
+        if (relative & mask) {
+            int parent = (relative - mask + root) % size;
+            int receive_bytes = get_piece_bytes(bytes, piece_bytes, relative, mask);
+            if (receive_bytes > 0) {
+                MPI_Recv(buffer + (long long)relative * piece_bytes, receive_bytes, MPI_CHAR, parent, TAG_BCAST, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            }
+            break;
+        }
+        mask <<= 1;
+    }
+    for (mask >>= 1; mask > 0; mask >>= 1) {
+        if (relative + mask < size) {
+            int send_bytes = get_piece_bytes(bytes, piece_bytes, relative + mask, mask);
+            if (send_bytes > 0) {
+                MPI_Send(buffer + (long long)(relative + mask) * piece_bytes, send_bytes, MPI_CHAR, (relative + mask + root) % size, TAG_BCAST, MPI_COMM_WORLD);
+            }
+        }
+    }
+
+    int left = (rank - 1 + size) % size;
+    int right = (rank + 1) % size;
+    for (int step = 0; step < size - 1; step++) {
+        int send_piece = (relative - step + size) % size;
+        int receive_piece = (relative - step - 1 + size) % size;
+        MPI_Sendrecv(buffer + (long long)send_piece * piece_bytes, get_piece_bytes(bytes, piece_bytes, send_piece, 1), MPI_CHAR, right, TAG_BCAST,
+                     buffer + (long long)receive_piece * piece_bytes, get_piece_bytes(bytes, piece_bytes, receive_piece, 1), MPI_CHAR, left, TAG_BCAST,
+                     MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+}
+
+/*
+Pipelined chain in ranks relative to the root: relative rank i receives each segment from i - 1 and forwards it to
+i + 1 with MPI_Isend, so it is already receiving segment s + 1 while segment s travels on.
+*/
+void chain_broadcast(char *buffer, int bytes, int root, int rank, int size) {
+    int relative = (rank - root + size) % size;
+    int previous = (rank - 1 + size) % size;
+    int next = (rank + 1) % size;
+    int segments = (int)(((long long)bytes + BCAST_SEGMENT_BYTES - 1) / BCAST_SEGMENT_BYTES);
+    int forwards = relative < size - 1;
+    MPI_Request *requests = forwards ? (MPI_Request *)malloc((segments > 0 ? segments : 1) * sizeof(MPI_Request)) : NULL;
+
+    for (int s = 0; s < segments; s++) {
+        char *segment = buffer + (long long)s * BCAST_SEGMENT_BYTES;
+        int segment_bytes = get_piece_bytes(bytes, BCAST_SEGMENT_BYTES, s, 1);
+        if (relative > 0) {
+            MPI_Recv(segment, segment_bytes, MPI_CHAR, previous, TAG_BCAST, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        }
+        if (forwards) {
+            MPI_Isend(segment, segment_bytes, MPI_CHAR, next, TAG_BCAST, MPI_COMM_WORLD, &requests[s]);
+        }
+    }
+
+    if (forwards) {
+        MPI_Waitall(segments, requests, MPI_STATUSES_IGNORE);
+        free(requests);
+    }
+}
+
+/*
+Short messages are latency bound and take the binomial tree. Long messages are bandwidth bound: the chain keeps
+every link busy once its pipeline is full, which needs at least as many segments as ranks, and everything in
+between (or too short to fill the chain) uses scatter-allgather.
+*/
+enum BroadcastAlgorithm choose_broadcast_algorithm(int bytes, int size) {
+    if (bytes < BCAST_SHORT_BYTES) {
+        return BCAST_BINOMIAL;
+    }
+    if (bytes >= BCAST_LONG_BYTES && bytes / BCAST_SEGMENT_BYTES >= size) {
+        return BCAST_CHAIN;
+    }
+    return BCAST_SCATTER_ALLGATHER;
+}
+
+void broadcast(char *buffer, int bytes, int root, enum BroadcastAlgorithm algorithm, int rank, int size) {
+    if (algorithm == BCAST_AUTO) {
+        algorithm = choose_broadcast_algorithm(bytes, size);
+    }
+    if (size == 1) {
+        return;
+    }
+    switch (algorithm) {
+        case BCAST_LINEAR:
+            linear_broadcast(buffer, bytes, root, rank, size);
+            break;
+        case BCAST_BINOMIAL:
+            binomial_broadcast(buffer, bytes, root, rank, size);
+            break;
+        case BCAST_SCATTER_ALLGATHER:
+            scatter_allgather_broadcast(buffer, bytes, root, rank, size);
+            break;
+        case BCAST_CHAIN:
+            chain_broadcast(buffer, bytes, root, rank, size);
+            break;
+        default:
+            MPI_Bcast(buffer, bytes, MPI_CHAR, root, MPI_COMM_WORLD);
+            break;
+    }
+}
+
+// The payload byte at index i of repetition r, so a stale buffer from an earlier repetition is caught
+char get_payload_byte(long long i, int repetition) {
+    return (char)((i * 131 + repetition * 7) & 0xff);
+}
+
+void run_benchmark(int bytes, int repetitions, int first_algorithm, int last_algorithm, int rank, int size) {
+    char *buffer = (char *)malloc(bytes > 0 ? bytes : 1);
+    int failures = 0;
+
+    for (int algorithm = first_algorithm; algorithm <= last_algorithm; algorithm++) {
+        for (int r = 0; r < repetitions; r++) {
+            for (int i = 0; i < bytes; i++) {
+                buffer[i] = rank == 0 ? get_payload_byte(i, r) : 0;
+            }
+
+            MPI_Barrier(MPI_COMM_WORLD);
+            double start_time = MPI_Wtime();
+            broadcast(buffer, bytes, 0, (enum BroadcastAlgorithm)algorithm, rank, size);
+            double elapsed = MPI_Wtime() - start_time;
+
+            int wrong = 0;
+            for (int i = 0; i < bytes && !wrong; i++) {
+                wrong = buffer[i] != get_payload_byte(i, r);
+            }
+
+            double slowest;
+            int wrong_ranks;
+            MPI_Reduce(&elapsed, &slowest, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+            MPI_Reduce(&wrong, &wrong_ranks, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+            if (rank == 0) {
+                printf("Elapsed time: %.9f seconds (%s, repetition %d, %d bytes)\n", slowest, algorithm_names[algorithm], r + 1, bytes);
+                if (wrong_ranks > 0) {
+                    printf("%s: %d ranks received a wrong payload\n", algorithm_names[algorithm], wrong_ranks);
+                    failures++;
+                }
+            }
+        }
+    }
+
+    free(buffer);
+    MPI_Bcast(&failures, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (failures > 0) {
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
 
 int main(int argc, char **argv) {
     int rank, size;
@@ -15,18 +271,54 @@ int main(int argc, char **argv) {
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
 
-    char broadcast_message[100];
+    // Positional byte count and repetitions, --algorithm anywhere
+    long long bytes = -1;
+    int repetitions = DEFAULT_REPETITIONS;
+    int first_algorithm = 0, last_algorithm = BCAST_ALGORITHMS - 1;
+    int positional = 0, usage_error = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--algorithm=", 12) == 0) {
+            int found = 0;
+            for (int a = 0; a < BCAST_ALGORITHMS; a++) {
+                if (strcmp(argv[i] + 12, algorithm_names[a]) == 0) {
+                    first_algorithm = last_algorithm = a;
+                    found = 1;
+                }
+            }
+            usage_error |= !found && strcmp(argv[i] + 12, "all") != 0;
+        } else if (positional == 0) {
+            bytes = atoll(argv[i]);
+            positional++;
+        } else if (positional == 1) {
+            repetitions = atoi(argv[i]);
+            positional++;
+        } else {
+            usage_error = 1;
+        }
+    }
+    if (usage_error || (positional > 0 && (bytes < 0 || bytes > INT_MAX || repetitions < 1))) {
+        if (rank == 0) {
+            fprintf(stderr, "Usage: %s [bytes] [repetitions] [--algorithm=all|linear|binomial|scatter-allgather|chain|auto|mpi]\n", argv[0]);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
+    if (positional > 0) {
+        run_benchmark((int)bytes, repetitions, first_algorithm, last_algorithm, rank, size);
+        MPI_Finalize();
+        return 0;
+    }
+
+    char broadcast_message[100] = {0};
     if (rank == 0) {
         strcpy(broadcast_message, "Hello World");
-        for (int i = 0; i < size; i++) {
-            MPI_Send(broadcast_message, strlen(broadcast_message) + 1, MPI_CHAR, i, 0, MPI_COMM_WORLD);
-        }
-    } else {
-        MPI_Recv(broadcast_message, 100, MPI_CHAR, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+    broadcast(broadcast_message, sizeof(broadcast_message), 0, BCAST_AUTO, rank, size);
+    if (rank != 0) {
         printf("Process %d received: %s\n", rank, broadcast_message);
     }
 
     MPI_Finalize();
     return 0;
 }
-
@@ -2,49 +2,340 @@
     Gather aka All-to-One mode.
     All processes contribute to the result.
     One process receives the result.
+
+    Usage: mpirun -np <p> ./gather [bytes per rank] [repetitions] [--algorithm=<a>]
+
+    Without arguments every rank contributes a different number of random values (rank % 3 + 1 of them), rank 0
+    collects them with MPI_Gatherv and prints them, and then every rank collects all of them with an allgather and
+    checks it has them all. The values travel as struct Result with a committed struct datatype, so each value
+    keeps the rank that inserted it.
+
+    With a byte count every rank contributes that many bytes, repetitions times (default 10), with each way of
+    collecting them (or only the one given with --algorithm). Each repetition starts after a barrier and is timed with
+    MPI_Wtime, rank 0 prints the time of the slowest rank for every repetition. The first repetition is the cold one.
+    The bytes of all ranks together must fit an int (at most 2147483647), since every rank's block sits at an int
+    displacement.
+
+    gather              MPI_Gather to rank 0, every contribution the same size
+    gatherv             Counts to rank 0 with MPI_Gather, a prefix sum of the counts for the displacements, then MPI_Gatherv
+    recursive-doubling  Allgather to every rank in log2(p) exchanges (ring when p is not a power of two)
+    ring                Allgather to every rank in p - 1 exchanges with the neighbours
+    allgather-mpi       The library's MPI_Allgatherv, for comparison
 */
 
 #include <stdio.h>
 #include <mpi.h>
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+
+#define DEFAULT_REPETITIONS 10
+
+#define TAG_ALLGATHER 0
+
 struct Result {
     int inserted_value;
     int rank_who_inserted;
 };
 
+enum Collect {
+    COLLECT_GATHER,
+    COLLECT_GATHERV,
+    COLLECT_RECURSIVE_DOUBLING,
+    COLLECT_RING,
+    COLLECT_ALLGATHER_MPI,
+    COLLECT_METHODS
+};
+
+const char *collect_names[COLLECT_METHODS] = {"gather", "gatherv", "recursive-doubling", "ring", "allgather-mpi"};
+
+// MPI datatype matching struct Result, padding included so arrays of it can be sent with a count
+MPI_Datatype create_result_type(void) {
+    int block_lengths[2] = {1, 1};
+    MPI_Aint displacements[2] = {offsetof(struct Result, inserted_value), offsetof(struct Result, rank_who_inserted)};
+    MPI_Datatype types[2] = {MPI_INT, MPI_INT};
+    MPI_Datatype struct_type, result_type;
+    MPI_Type_create_struct(2, block_lengths, displacements, types, &struct_type);
+    MPI_Type_create_resized(struct_type, 0, sizeof(struct Result), &result_type);
+    MPI_Type_commit(&result_type);
+    MPI_Type_free(&struct_type);
+    return result_type;
+}
+
+size_t get_type_extent(MPI_Datatype type) {
+    MPI_Aint lower_bound, extent;
+    MPI_Type_get_extent(type, &lower_bound, &extent);
+    return (size_t)extent;
+}
+
+// Displacement of each rank's block is the sum of the counts before it, returns the total count. MPI takes the
+// displacements as int, so callers keep the total within INT_MAX; it is summed in long long all the same
+long long get_displacements(const int *counts, int *displacements, int size) {
+    long long total = 0;
+    for (int r = 0; r < size; r++) {
+        displacements[r] = (int)total;
+        total += counts[r];
+    }
+    return total;
+}
+
+/*
+Variable-size gather to root: every rank may contribute a different count.
+Root first learns every count with MPI_Gather, turns them into displacements with a prefix sum and receives
+the blocks with MPI_Gatherv. On root *gathered, *counts and *displacements are allocated and the total count is
+returned, other ranks get NULL and 0.
+*/
+long long gather_variable(const void *contribution, int count, MPI_Datatype type, int root, int rank, int size, void **gathered, int **counts, int **displacements) {
+    *gathered = NULL;
+    *counts = NULL;
+    *displacements = NULL;
+    if (rank == root) {
+        *counts = (int *)malloc(size * sizeof(int));
+        *displacements = (int *)malloc(size * sizeof(int));
+    }
+    MPI_Gather(&count, 1, MPI_INT, *counts, 1, MPI_INT, root, MPI_COMM_WORLD);
+
+    long long total = 0;
+    if (rank == root) {
+        total = get_displacements(*counts, *displacements, size);
+        *gathered = malloc(total > 0 ? (size_t)total * get_type_extent(type) : 1);
+    }
+    MPI_Gatherv(contribution, count, type, *gathered, *counts, *displacements, type, root, MPI_COMM_WORLD);
+    return total;
+}
+
+/*
+Recursive doubling allgather, in place: each rank's block is already at its displacement in buffer.
+- In step k a rank exchanges with the rank 2^k away (rank ^ 2^k) everything it has so far
+- Before step k a rank holds the blocks of the 2^k ranks that share its rank above bit k, and those blocks
+  sit next to each other in buffer because displacements follow rank order, so each exchange is one message
+- After log2(p) steps every rank holds every block. p must be a power of two
+*/
+void recursive_doubling_allgatherv(char *buffer, const int *counts, const int *displacements, MPI_Datatype type, int rank, int size) {
+    size_t extent = get_type_extent(type);
+    for (int distance = 1; distance < size; distance *= 2) {
+        int partner = rank ^ distance;
+        int my_first = rank & ~(distance - 1);
+        int partner_first = partner & ~(distance - 1);
+        int my_count = 0, partner_count = 0;
+        for (int r = 0; r < distance; r++) {
+            my_count += counts[my_first + r];
+            partner_count += counts[partner_first + r];
+        }
+        MPI_Sendrecv(buffer + displacements[my_first] * extent, my_count, type, partner, TAG_ALLGATHER,
+                     buffer + displacements[partner_first] * extent, partner_count, type, partner, TAG_ALLGATHER,
+                     MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+}
+
+// Ring allgather, in place: in step s every rank passes the block it received last (its own first) to the right
+void ring_allgatherv(char *buffer, const int *counts, const int *displacements, MPI_Datatype type, int rank, int size) {
+    size_t extent = get_type_extent(type);
+    int left = (rank - 1 + size) % size;
+    int right = (rank + 1) % size;
+    for (int step = 0; step < size - 1; step++) {
+        int send_block = (rank - step + size) % size;
+        int receive_block = (rank - step - 1 + size) % size;
+        MPI_Sendrecv(buffer + displacements[send_block] * extent, counts[send_block], type, right, TAG_ALLGATHER,
+                     buffer + displacements[receive_block] * extent, counts[receive_block], type, left, TAG_ALLGATHER,
+                     MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+}
+
+void allgatherv_in_place(char *buffer, const int *counts, const int *displacements, MPI_Datatype type, enum Collect method, int rank, int size) {
+    int power_of_two = (size & (size - 1)) == 0;
+    if (method == COLLECT_RECURSIVE_DOUBLING && power_of_two) {
+        recursive_doubling_allgatherv(buffer, counts, displacements, type, rank, size);
+    } else if (method == COLLECT_RECURSIVE_DOUBLING || method == COLLECT_RING) {
+        ring_allgatherv(buffer, counts, displacements, type, rank, size);
+    } else {
+        MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, buffer, counts, displacements, type, MPI_COMM_WORLD);
+    }
+}
+
+/*
+Variable-size allgather: every rank ends up with every rank's contribution in rank order.
+The counts are shared first with the same algorithm (one MPI_INT per rank), then each rank places its own block at
+its displacement and the blocks are exchanged in place. *gathered, *counts and *displacements are allocated on
+every rank and the total count is returned.
+*/
+long long allgather_variable(const void *contribution, int count, MPI_Datatype type, enum Collect method, int rank, int size, void **gathered, int **counts, int **displacements) {
+    *counts = (int *)malloc(size * sizeof(int));
+    *displacements = (int *)malloc(size * sizeof(int));
+    int *ones = (int *)malloc(size * sizeof(int));
+    for (int r = 0; r < size; r++) {
+        ones[r] = 1;
+        (*displacements)[r] = r;
+    }
+    (*counts)[rank] = count;
+    allgatherv_in_place((char *)*counts, ones, *displacements, MPI_INT, method, rank, size);
+    free(ones);
+
+    long long total = get_displacements(*counts, *displacements, size);
+    size_t extent = get_type_extent(type);
+    *gathered = malloc(total > 0 ? (size_t)total * extent : 1);
+    memcpy((char *)*gathered + (size_t)(*displacements)[rank] * extent, contribution, (size_t)count * extent);
+    allgatherv_in_place((char *)*gathered, *counts, *displacements, type, method, rank, size);
+    return total;
+}
+
+void run_benchmark(int bytes, int repetitions, int first_method, int last_method, int rank, int size) {
+    char *contribution = (char *)malloc(bytes > 0 ? bytes : 1);
+    char *gathered = NULL;
+    int failures = 0;
+    for (int i = 0; i < bytes; i++) {
+        contribution[i] = (char)(rank + i);
+    }
+    if (rank == 0) {
+        gathered = (char *)malloc((size_t)size * bytes + 1);
+    }
+
+    for (int method = first_method; method <= last_method; method++) {
+        for (int r = 0; r < repetitions; r++) {
+            char *collected = gathered;
+            int *counts = NULL, *displacements = NULL;
+
+            MPI_Barrier(MPI_COMM_WORLD);
+            double start_time = MPI_Wtime();
+            if (method == COLLECT_GATHER) {
+                MPI_Gather(contribution, bytes, MPI_BYTE, gathered, bytes, MPI_BYTE, 0, MPI_COMM_WORLD);
+            } else if (method == COLLECT_GATHERV) {
+                gather_variable(contribution, bytes, MPI_BYTE, 0, rank, size, (void **)&collected, &counts, &displacements);
+            } else {
+                allgather_variable(contribution, bytes, MPI_BYTE, (enum Collect)method, rank, size, (void **)&collected, &counts, &displacements);
+            }
+            double elapsed = MPI_Wtime() - start_time;
+
+            // Rank 0 checks the gathers, every rank checks the allgathers
+            int wrong = 0;
+            if (collected != NULL) {
+                for (long long i = 0; i < (long long)size * bytes && !wrong; i++) {
+                    wrong = collected[i] != (char)(i / bytes + i % bytes);
+                }
+            }
+            if (collected != gathered) {
+                free(collected);
+            }
+            free(counts);
+            free(displacements);
+
+            double slowest;
+            int wrong_ranks;
+            MPI_Reduce(&elapsed, &slowest, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+            MPI_Reduce(&wrong, &wrong_ranks, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+            if (rank == 0) {
+                printf("Elapsed time: %.9f seconds (%s, repetition %d, %d bytes per rank)\n", slowest, collect_names[method], r + 1, bytes);
+                if (wrong_ranks > 0) {
+                    printf("%s: %d ranks collected wrong bytes\n", collect_names[method], wrong_ranks);
+                    failures++;
+                }
+            }
+        }
+    }
+
+    free(contribution);
+    free(gathered);
+    MPI_Bcast(&failures, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (failures > 0) {
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
+
 int main(int argc, char **argv) {
     int rank, size;
-    srand(time(NULL));
 
     MPI_Init(&argc, &argv);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
+    srand(time(NULL) + rank);
 
-    struct Result *result_arr = malloc(size * sizeof(struct Result));
-
-    if (rank == 0) {
-        for (int i = 0; i < size; i++) {
-            MPI_Send(&result_arr[rank], 1, MPI_INT, i, 0, MPI_COMM_WORLD);
+    // Positional byte count and repetitions, --algorithm anywhere
+    long long bytes = -1;
+    int repetitions = DEFAULT_REPETITIONS;
+    int first_method = 0, last_method = COLLECT_METHODS - 1;
+    int positional = 0, usage_error = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--algorithm=", 12) == 0) {
+            int found = 0;
+            for (int c = 0; c < COLLECT_METHODS; c++) {
+                if (strcmp(argv[i] + 12, collect_names[c]) == 0) {
+                    first_method = last_method = c;
+                    found = 1;
+                }
+            }
+            usage_error |= !found && strcmp(argv[i] + 12, "all") != 0;
+        } else if (positional == 0) {
+            bytes = atoll(argv[i]);
+            positional++;
+        } else if (positional == 1) {
+            repetitions = atoi(argv[i]);
+            positional++;
+        } else {
+            usage_error = 1;
         }
-    } else {
-        MPI_Recv(&result_arr[rank], 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-        int insert_value = rand() % 100;
-        result_arr[rank].inserted_value = insert_value;
-        result_arr[rank].rank_who_inserted = rank;
+    }
+    if (usage_error || (positional > 0 && (bytes < 0 || repetitions < 1))) {
+        if (rank == 0) {
+            fprintf(stderr, "Usage: %s [bytes per rank] [repetitions] [--algorithm=all|gather|gatherv|recursive-doubling|ring|allgather-mpi]\n", argv[0]);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    // Gatherv and Allgatherv place every block at an int displacement, so all ranks' bytes together must fit an int
+    if (positional > 0 && (long long)size * bytes > INT_MAX) {
+        if (rank == 0) {
+            fprintf(stderr, "%d ranks x %lld bytes exceeds %d bytes gathered in total\n", size, bytes, INT_MAX);
+        }
+        MPI_Finalize();
+        return 1;
     }
 
-    MPI_Gather(&result_arr[rank], 1, MPI_INT, result_arr, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (positional > 0) {
+        run_benchmark((int)bytes, repetitions, first_method, last_method, rank, size);
+        MPI_Finalize();
+        return 0;
+    }
 
-    int *result_arr_final = malloc(size * sizeof(int));
+    MPI_Datatype result_type = create_result_type();
+
+    // Every rank inserts its own values, a different number of them per rank
+    int count = rank % 3 + 1;
+    struct Result *results = (struct Result *)malloc(count * sizeof(struct Result));
+    for (int i = 0; i < count; i++) {
+        results[i].inserted_value = rand() % 100;
+        results[i].rank_who_inserted = rank;
+    }
+
+    struct Result *gathered;
+    int *counts, *displacements;
+    long long total = gather_variable(results, count, result_type, 0, rank, size, (void **)&gathered, &counts, &displacements);
     if (rank == 0) {
-        for (int i = 0; i < size; i++) {
-            result_arr_final[i] = result_arr[i].inserted_value;
-            printf("inserted_value: %d, rank_who_inserted: %d\n", result_arr_final[i], result_arr[i].rank_who_inserted);
+        for (long long i = 0; i < total; i++) {
+            printf("inserted_value: %d, rank_who_inserted: %d\n", gathered[i].inserted_value, gathered[i].rank_who_inserted);
         }
     }
+    free(gathered);
+    free(counts);
+    free(displacements);
+
+    // Every rank collects every value and checks that each rank's block holds that rank's values
+    total = allgather_variable(results, count, result_type, COLLECT_RECURSIVE_DOUBLING, rank, size, (void **)&gathered, &counts, &displacements);
+    int wrong = 0;
+    for (int r = 0; r < size; r++) {
+        wrong |= counts[r] != r % 3 + 1;
+        for (int i = 0; i < counts[r]; i++) {
+            wrong |= gathered[displacements[r] + i].rank_who_inserted != r;
+        }
+    }
+    printf("Process %d: has all %lld values from the allgather%s\n", rank, total, wrong ? ", but some are wrong" : "");
+    free(gathered);
+    free(counts);
+    free(displacements);
+
+    free(results);
+    MPI_Type_free(&result_type);
     MPI_Finalize();
-    free(result_arr);
-    free(result_arr_final);
-    return 0;
-}
\ No newline at end of file
+    return wrong;
+}
@@ -45,41 +45,965 @@ Sorted ratings:
 2: 3.2
 3: 3.0
 4: 2.2
+
+Build:
+
+    mpicc -O2 -fopenmp OnlineRatings.c -o OnlineRatings -lm
+
+-fopenmp is optional. Without it every rank runs a single thread. -DRATINGS_PROFILE compiles in the phase
+timers and message counters described at PROFILE_BEGIN.
+
+Usage:
+
+    mpirun -np <p> ./OnlineRatings <m> <n> [options]
+
+n is a 64-bit count. Products with more than MAX_RATINGS_PER_MESSAGE ratings are generated, sent and summed
+in chunks of that size, so no MPI count exceeds the int range and no buffer holds a whole product.
+
+Options:
+
+    --schedule=static   One product per worker rank, m <= p - 1 (default, the assignment's layout)
+    --schedule=dynamic  Master/worker work queue: workers keep requesting batches of products from
+                        rank 0 until the queue is empty, so m is no longer capped by the rank count
+    --batch=<b>         Number of products handed out per request in dynamic mode (default picks
+                        roughly 8 batches per worker so slow workers do not hold up the tail)
+    --generate=master   Rank 0 generates every product's ratings and sends them to the workers (default)
+    --generate=worker   Each worker generates its own products' ratings locally, nothing is sent but
+                        the work assignments and the results
+    --seed=<s>          Use the counter-based generator with seed s instead of rand(). Ratings then
+                        depend only on (seed, product, rating index), so a given seed produces
+                        bit-identical averages whatever the rank count, schedule or generate mode.
+                        --generate=worker always uses the counter-based generator; without --seed,
+                        rank 0 picks a seed from the clock and prints it so the run can be repeated
+    --skew=<s>          Give the products Zipf-distributed rating counts instead of n each: product p gets
+                        about m * n * p^-s / (1^-s + ... + m^-s) ratings and at least one, so product 1 is the
+                        hottest and m * n must be at most MAX_RATINGS_PER_PRODUCT. The p2p paths hand each
+                        product to one worker as before, so the hot products set the run time. The
+                        collective path instead splits the concatenation of all products' ratings into one
+                        even range per rank with calculate_start_and_count: a hot product is spread over
+                        several ranks, light products are packed into one rank's range, and the ranks'
+                        partial histograms of the products at their range boundaries are added up on rank 0
+    --encoding=<e>      How rank 0 puts ratings on the wire when it sends them to the workers:
+                        int     4 bytes per rating as MPI_INT (default)
+                        u8      1 byte per rating as MPI_UINT8_T
+                        packed  3 bits per rating, 21 ratings per 64-bit word as MPI_UINT64_T
+                        Workers count the u8 and packed forms directly without unpacking them first
+    --threads=<t>       Threads per rank (OpenMP builds only, default OMP_NUM_THREADS). Each rank splits
+                        the counting and the counter-based generation of its current chunk across its
+                        threads, so a hybrid run of one rank per node or socket uses every core without
+                        the extra ranks. MPI is initialized with MPI_THREAD_FUNNELED: only the thread
+                        that called MPI_Init_thread makes MPI calls
+    --pipeline          Overlap generation, transfer and counting. Rank 0 fills one chunk buffer while
+                        the previous chunk is in flight with MPI_Isend, and a worker receives chunk
+                        k + 1 with MPI_Irecv while it counts chunk k. Static-mode results are received
+                        with MPI_Irecv posted before the first send instead of after the last one
+    --chunk=<c>         Ratings per message (default 65,536 with --pipeline, otherwise the whole
+                        product up to MAX_RATINGS_PER_MESSAGE, and at most INT_MAX / ranks)
+    --path=p2p          Point-to-point master/worker messages as selected by --schedule (default)
+    --path=collective   Every rank, rank 0 included, scores a share of the products. Rank 0 generates a
+                        round of products and hands them out with MPI_Scatterv, results come back in a
+                        single MPI_Gatherv of struct RatingToRank with a committed derived datatype, and
+                        the best product is found with MPI_Reduce and a custom MPI_Op. Collectives let
+                        the MPI library use tree algorithms instead of O(m) messages through rank 0
+    --path=shared       The collective path's rounds and result collection, but the ratings are not
+                        scattered into a private buffer on every rank. Each node keeps one MPI-3
+                        shared-memory window (MPI_Win_allocate_shared on the node communicator from
+                        MPI_Comm_split_type), rank 0 generates into its own node's window and sends every
+                        other node one copy, and each rank counts its products in place in the window.
+                        Needs --generate=master
+    --path=rma          One-sided master/worker path: rank 0 never posts a send or receive. It exposes its generated
+                        ratings, a work counter and every product's histogram in windows made with MPI_Win_create,
+                        and keeps generating the next round into a second buffer while the workers, under a
+                        passive-target MPI_Win_lock_all epoch, claim a chunk with MPI_Fetch_and_op, fetch it with
+                        MPI_Get and add its histogram into rank 0's with MPI_Accumulate. Needs --generate=master
+    --top=<k>           Only rank and print the k best products. Ranks that hold results keep their
+                        local top k with a size-k heap, rank 0 gathers the k-long lists and does a k-way
+                        merge (dynamic and collective paths). Where rank 0 already holds every result it
+                        selects the top k with the same heap instead of sorting all m
+    --rank-by=<key>     What products are ranked by. Every product's ratings are counted into a 5-bin histogram
+                        in one pass, and all of these come from it:
+                        mean      the average rating (default)
+                        bayesian  the average with --prior pretend ratings added, so products with
+                                  few ratings cannot top the list on a handful of 5s
+                        median    the exact median
+                        p25, p75  the 25th and 75th percentiles (nearest rank)
+                        Ties go to the higher mean, then to the lower product index
+    --prior=<c>,<w>     Prior of the Bayesian average: w pretend ratings of c (default 3,10)
+    --stats             Print every statistic of each product: variance, median, percentiles and Bayesian
+                        average next to the mean and the rating count
+    --timing            Print the time from the start of distribution until the results are sorted,
+                        measured with MPI_Wtime after a barrier, to compare paths and options
+    --kernel=<k>        Histogram kernel: auto (default, the widest the CPU supports), scalar, avx2 or
+                        avx512. Every kernel ends up with 64-bit counts
+    --bench-kernels     Run only the histogram microbenchmark on rank 0 over n ratings and report GB/s
+                        for every encoding and available kernel against the original int summation loop
+    --input=<path>      Score real ratings from a file instead of generating them. Every rank opens the
+                        file collectively with MPI-IO and reads only its own byte range, so there is no
+                        master/worker split and a single rank is enough
+    --input-format=<f>  binary or csv, by default csv when the path ends in .csv and binary otherwise
+
+        binary: m * n bytes, one byte per rating, product 1's n ratings first, then product 2's, ...
+        csv:    one "product,rating" record per line, product in 1..m, rating in 1..5. Products may have
+                any number of ratings and n is ignored. Lines that do not parse (a header, for example)
+                are skipped and counted. A line belongs to the rank whose byte range holds its first
+                byte, so ranks skip the partial line at the start of their range and read past the end
+                of their range to finish their last line
+    --service=<b>       Keep running as a rating service for b batches of new ratings instead of scoring once.
+                        Workers own a block of products each, score its n initial ratings once and then keep
+                        a running count and sum per product. Rank 0 routes each batch to the owners with
+                        persistent requests (MPI_Send_init / MPI_Recv_init, MPI_Start per batch) and prints
+                        the merged top k (--top, default 10) and the batch latency after every batch. Ratings
+                        come from the counter-based generator, --schedule, --path and --encoding do not apply
+    --delta=<d>         New ratings per service batch (default 4,096)
+    --snapshot=<path>   Service mode: every --snapshot-every batches and after the last one, save every product's
+                        histogram (its count, sum and everything else score_histogram needs) to a versioned binary
+                        snapshot: a 64-byte header with the seed and the watermark, the number of batches folded in,
+                        then m records of 5 64-bit counts in product order, in the machine's byte order. The file
+                        is written collectively with MPI-IO, each worker writing its own block of records, to
+                        <path>.tmp, which rank 0 renames over <path> so a crash never leaves a torn snapshot
+    --snapshot-every=<b> Batches between snapshots (default 10)
+    --restore=<path>    Service mode: start from a snapshot instead of scoring the history. Each worker memory-maps
+                        the file and copies its block's records, so startup costs O(m) whatever the history, and
+                        the run continues with the snapshot's seed from the batch after its watermark up to
+                        --service. The batches depend on m, n, --delta and the worker count, so all four must
+                        match the snapshot, and --seed cannot be given
+    --trace=<prefix>    Profiling builds only (-DRATINGS_PROFILE): also write each rank's phase timeline to
+                        <prefix>.<rank>.json in the Chrome trace format. Profiling builds always end with a
+                        min / mean / max report of per-phase times, messages and bytes sent across the ranks
 */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <math.h>
 #include <time.h>
 #include <mpi.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
 // This is used to format the n with commas when printing to the console
 #include <locale.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Tags used between the master and the workers
+#define TAG_RATINGS 0       // master -> worker: an array of n ratings for one product
+#define TAG_RESULT 1        // worker -> master: averages computed by the worker
+#define TAG_WORK_ASSIGN 2   // master -> worker (dynamic): {first product, product count}, count 0 means stop
+#define TAG_DELTA 3         // master -> worker (service): {product, rating} pairs of one batch of new ratings
+
+// Largest number of ratings generated, sent or received in one piece. Longer products are streamed in
+// several messages, which keeps every MPI count far below INT_MAX and bounds every ratings buffer
+#define MAX_RATINGS_PER_MESSAGE (1 << 24)
+// Sums of up to this many ratings of at most 5 stay well inside a signed 64-bit integer
+#define MAX_RATINGS_PER_PRODUCT (1LL << 40)
+
+// Ratings of small products packed into one rank's segment per collective round (4 MB as ints). This is a
+// budget for the whole segment, separate from chunk_size, which never exceeds the largest product
+#define SEGMENT_RATINGS (1 << 20)
+
+// Ratings per message in --pipeline mode when --chunk is not given, small enough that generating,
+// sending and summing a chunk each take a fraction of a product's time
+#define PIPELINE_CHUNK_RATINGS (1 << 16)
+
+// Chunks shorter than this are summed or generated on one thread, it is not worth waking the others
+#define THREADED_MIN_RATINGS (1 << 16)
+
+// Smallest amount of work timed per kernel in --bench-kernels
+#define BENCH_MIN_SECONDS 0.25
+
+// 21 three-bit ratings fit in a 64-bit word, the top bit is unused
+#define RATINGS_PER_PACKED_WORD 21
+#define PACKED_FIELD_BITS 3
+// Bit 0 of every 3-bit field, the masks for bits 1 and 2 are this shifted left by 1 and 2
+#define PACKED_LOW_BITS 0x1249249249249249ULL
+
+// Bytes each rank reads per collective MPI-IO call when ingesting a file
+#define INPUT_BLOCK_BYTES (16 * 1024 * 1024)
+// Bytes read at a time past the end of a rank's range while finishing its last CSV line
+#define INPUT_TAIL_BYTES 4096
+
+// Dynamic mode aims for this many batches per worker when --batch is not given
+#define BATCHES_PER_WORKER 8
+
+// Service mode defaults for --delta and --top
+#define SERVICE_DELTA_RATINGS 4096
+#define SERVICE_TOP_K 10
+#define SNAPSHOT_EVERY_BATCHES 10
+// First bytes of a snapshot file and the layout version after them
+#define SNAPSHOT_MAGIC "RATESNAP"
+#define SNAPSHOT_VERSION 1
+
+// Ratings are 1 through RATING_VALUES, histograms have one bin per value
+#define RATING_VALUES 5
+
+// Default --prior of the Bayesian average: PRIOR_WEIGHT pretend ratings of PRIOR_MEAN
+#define PRIOR_MEAN 3.0
+#define PRIOR_WEIGHT 10.0
+
+enum Schedule {
+    SCHEDULE_STATIC,
+    SCHEDULE_DYNAMIC
+};
+
+enum Generate {
+    GENERATE_MASTER,
+    GENERATE_WORKER
+};
+
+enum Encoding {
+    ENCODING_INT,
+    ENCODING_U8,
+    ENCODING_PACKED
+};
+
+enum Path {
+    PATH_P2P,
+    PATH_COLLECTIVE,
+    PATH_SHARED,
+    PATH_RMA
+};
+
+enum Kernel {
+    KERNEL_AUTO,
+    KERNEL_SCALAR,
+    KERNEL_AVX2,
+    KERNEL_AVX512
+};
+
+enum InputFormat {
+    INPUT_BINARY,
+    INPUT_CSV
+};
+
+enum RankBy {
+    RANK_BY_MEAN,
+    RANK_BY_BAYESIAN,
+    RANK_BY_MEDIAN,
+    RANK_BY_PERCENTILE_25,
+    RANK_BY_PERCENTILE_75
+};
+
+struct Options {
+    int m;
+    long long n;
+    const char *input_path; // NULL when ratings are generated
+    enum InputFormat input_format;
+    int has_input_format;
+    enum Schedule schedule;
+    int batch_size;
+    enum Encoding encoding;
+    enum Kernel kernel;
+    int bench_kernels;
+    int threads; // 0 keeps the OpenMP default
+    int pipeline;
+    int chunk_size; // ratings per message
+    enum Path path;
+    int top_k; // 0 ranks every product
+    enum RankBy rank_by;
+    double prior_mean;
+    double prior_weight;
+    int stats; // print every statistic, not just the mean
+    int timing;
+    int service_batches; // 0 scores once and exits
+    int delta;           // new ratings per service batch
+    const char *snapshot_path; // NULL without --snapshot
+    int snapshot_every;
+    const char *restore_path;  // NULL without --restore
+    int watermark;             // batches already folded into the restored snapshot
+    const char *trace_prefix; // --trace, NULL without it
+    enum Generate generate;
+    int use_counter_rng; // 1 when ratings come from the (seed, product) streams instead of rand()
+    int has_seed;
+    uint64_t seed;
+    int has_skew;
+    double skew;
+    long long *product_ratings; // each product's rating count with --skew, NULL when every product has n
+};
+
+/*
+Profiling, compiled in with -DRATINGS_PROFILE (mpicc -O2 -DRATINGS_PROFILE OnlineRatings.c).
+
+PROFILE_BEGIN and PROFILE_END bracket the hot phases on the thread that makes the MPI calls and add the wall
+time to a per-phase total, PROFILE_SEND counts one message of the given size (a collective counts once with the
+bytes this rank contributes). When the run ends every rank's totals are reduced to min, mean and max on rank 0,
+so a single report shows both load imbalance and how communication compares with compute. With --trace=<prefix>
+each rank also writes its phase intervals to <prefix>.<rank>.json in the Chrome trace event format, which
+chrome://tracing and Perfetto show as one timeline per rank. Without the define the macros expand to nothing.
+*/
+#ifdef RATINGS_PROFILE
+
+// Trace events kept per rank, later ones are counted but dropped so a long run cannot exhaust memory
+#define PROFILE_MAX_TRACE_EVENTS (1 << 20)
+
+enum ProfilePhase {
+    PROFILE_GENERATE,
+    PROFILE_ENCODE,
+    PROFILE_HISTOGRAM,
+    PROFILE_SORT,
+    PROFILE_PRINT,
+    PROFILE_SEND,
+    PROFILE_RECEIVE,
+    PROFILE_COLLECTIVE,
+    PROFILE_READ,
+    PROFILE_PHASES
+};
+
+// Phases before this one are compute, the rest are communication or I/O
+#define PROFILE_FIRST_COMMUNICATION PROFILE_SEND
+
+const char *profile_phase_names[PROFILE_PHASES] = {"generate", "encode", "histogram", "sort", "print", "send", "receive", "collective", "read"};
+
+struct TraceEvent {
+    double start;
+    double end;
+    int phase;
+};
+
+struct Profile {
+    double totals[PROFILE_PHASES];
+    double starts[PROFILE_PHASES];
+    long long messages_sent;
+    long long bytes_sent;
+    double origin; // MPI_Wtime after the starting barrier, trace times are relative to it
+    const char *trace_prefix;
+    struct TraceEvent *events;
+    long long event_count;
+    long long event_capacity;
+    long long dropped_events;
+};
+
+struct Profile profile;
+
+void profile_begin(enum ProfilePhase phase) {
+    profile.starts[phase] = MPI_Wtime();
+}
+
+void profile_end(enum ProfilePhase phase) {
+    double end = MPI_Wtime();
+    profile.totals[phase] += end - profile.starts[phase];
+    if (profile.trace_prefix == NULL) {
+        return;
+    }
+    if (profile.event_count == profile.event_capacity) {
+        if (profile.event_capacity == PROFILE_MAX_TRACE_EVENTS) {
+            profile.dropped_events++;
+            return;
+        }
+        profile.event_capacity = profile.event_capacity == 0 ? 1024 : 2 * profile.event_capacity;
+        profile.events = (struct TraceEvent *)realloc(profile.events, profile.event_capacity * sizeof(struct TraceEvent));
+    }
+    struct TraceEvent event = {profile.starts[phase], end, phase};
+    profile.events[profile.event_count++] = event;
+}
+
+void profile_send(long long bytes) {
+    profile.messages_sent++;
+    profile.bytes_sent += bytes;
+}
+
+// Collective, the barrier lines the ranks' trace origins up
+void profile_start(const char *trace_prefix) {
+    memset(&profile, 0, sizeof(profile));
+    profile.trace_prefix = trace_prefix;
+    MPI_Barrier(MPI_COMM_WORLD);
+    profile.origin = MPI_Wtime();
+}
 
+void write_profile_trace(int rank) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%d.json", profile.trace_prefix, rank);
+    FILE *trace = fopen(path, "w");
+    if (trace == NULL) {
+        printf("Rank %d could not write the trace %s\n", rank, path);
+        return;
+    }
+    fprintf(trace, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(trace, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"rank %d\"}}", rank, rank);
+    for (long long i = 0; i < profile.event_count; i++) {
+        struct TraceEvent *event = &profile.events[i];
+        fprintf(trace, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": 0, \"ts\": %.3f, \"dur\": %.3f}", profile_phase_names[event->phase], rank,
+                (event->start - profile.origin) * 1e6, (event->end - event->start) * 1e6);
+    }
+    fprintf(trace, "\n]}\n");
+    fclose(trace);
+    if (profile.dropped_events > 0) {
+        printf("Rank %d dropped %lld trace events past the first %d\n", rank, profile.dropped_events, PROFILE_MAX_TRACE_EVENTS);
+    }
+}
+
+// Collective, rank 0 prints the min / mean / max of every total across the ranks
+void profile_report(int rank, int size) {
+    enum { COMPUTE = PROFILE_PHASES, COMMUNICATION, MESSAGES, BYTES, VALUES };
+    double values[VALUES] = {0};
+    for (int phase = 0; phase < PROFILE_PHASES; phase++) {
+        values[phase] = profile.totals[phase];
+        values[phase < PROFILE_FIRST_COMMUNICATION ? COMPUTE : COMMUNICATION] += profile.totals[phase];
+    }
+    values[MESSAGES] = (double)profile.messages_sent;
+    values[BYTES] = (double)profile.bytes_sent;
+
+    double minimums[VALUES], maximums[VALUES], sums[VALUES];
+    MPI_Reduce(values, minimums, VALUES, MPI_DOUBLE, MPI_MIN, 0, MPI_COMM_WORLD);
+    MPI_Reduce(values, maximums, VALUES, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(values, sums, VALUES, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    if (profile.trace_prefix != NULL) {
+        write_profile_trace(rank);
+    }
+    free(profile.events);
+    if (rank != 0) {
+        return;
+    }
+
+    printf("\nProfile over %d ranks (max / mean is the load imbalance)\n\n", size);
+    printf("%-16s %14s %14s %14s %10s\n", "seconds", "min", "mean", "max", "max / mean");
+    for (int i = 0; i < VALUES; i++) {
+        if (i == MESSAGES) {
+            printf("\n%-16s %14s %14s %14s\n", "per rank", "min", "mean", "max");
+        }
+        const char *name = i < PROFILE_PHASES ? profile_phase_names[i] : i == COMPUTE ? "compute total" : i == COMMUNICATION ? "comm total" : i == MESSAGES ? "messages sent" : "bytes sent";
+        double mean = sums[i] / size;
+        if (i >= MESSAGES) {
+            printf("%-16s %'14.0f %'14.0f %'14.0f\n", name, minimums[i], mean, maximums[i]);
+        } else {
+            printf("%-16s %14.6f %14.6f %14.6f %10.2f\n", name, minimums[i], mean, maximums[i], mean > 0 ? maximums[i] / mean : 0.0);
+        }
+    }
+}
+
+#define PROFILE_BEGIN(phase) profile_begin(phase)
+#define PROFILE_END(phase) profile_end(phase)
+#define PROFILE_SEND(bytes) profile_send(bytes)
+#else
+#define PROFILE_BEGIN(phase)
+#define PROFILE_END(phase)
+#define PROFILE_SEND(bytes)
+#endif
+
+// One scored product, every statistic score_histogram derives from its ratings
 struct RatingToRank {
     double average_rating;
-    int rank;
+    double score;            // the --rank-by key products are ordered by
+    double variance;         // population variance
+    double median;
+    double percentile_25;
+    double percentile_75;
+    double bayesian_average;
+    long long rating_count;
+    int rank;    // worker that computed the average
+    int product; // product index, 1 through m
 };
 
+#define RATING_TO_RANK_DOUBLES 7
+
+// MPI datatype matching struct RatingToRank, committed once in main by create_rating_to_rank_type
+MPI_Datatype rating_to_rank_type;
+
+void create_rating_to_rank_type(void) {
+    // The doubles from average_rating to bayesian_average are one block, as are rank and product
+    int block_lengths[3] = {RATING_TO_RANK_DOUBLES, 1, 2};
+    MPI_Aint displacements[3] = {
+        offsetof(struct RatingToRank, average_rating),
+        offsetof(struct RatingToRank, rating_count),
+        offsetof(struct RatingToRank, rank)
+    };
+    MPI_Datatype types[3] = {MPI_DOUBLE, MPI_LONG_LONG, MPI_INT};
+    MPI_Datatype packed_type;
+
+    MPI_Type_create_struct(3, block_lengths, displacements, types, &packed_type);
+    // Resize so arrays of the struct (padding included) can be sent with a count
+    MPI_Type_create_resized(packed_type, 0, sizeof(struct RatingToRank), &rating_to_rank_type);
+    MPI_Type_commit(&rating_to_rank_type);
+    MPI_Type_free(&packed_type);
+}
+
+// Higher score first, then the higher average, and the lower product index wins a tie
+int is_better_rating(const struct RatingToRank *a, const struct RatingToRank *b) {
+    if (a->score != b->score) {
+        return a->score > b->score;
+    }
+    if (a->average_rating != b->average_rating) {
+        return a->average_rating > b->average_rating;
+    }
+    return a->product < b->product;
+}
+
+// MPI_Op keeping the better of two RatingToRank values element by element
+void best_rating_op(void *in, void *inout, int *len, MPI_Datatype *datatype) {
+    (void)datatype;
+    struct RatingToRank *candidates = (struct RatingToRank *)in;
+    struct RatingToRank *best = (struct RatingToRank *)inout;
+    for (int i = 0; i < *len; i++) {
+        if (is_better_rating(&candidates[i], &best[i])) {
+            best[i] = candidates[i];
+        }
+    }
+}
+
 void get_ratings(int *ratings, int n) {
+    PROFILE_BEGIN(PROFILE_GENERATE);
     for (int i = 0; i < n; i++) {
         ratings[i] = (rand() % 5) + 1;
     }
+    PROFILE_END(PROFILE_GENERATE);
 }
 
-double get_average_for_ratings(int *ratings, int n) {
-    int sum = 0;
-    for (int i = 0; i < n; i++) {
-        sum += ratings[i];
+/*
+Counter-based rating streams.
+
+Rating j of product p is a pure function of (seed, p, j): the key for product p is a hash of the seed and
+p, and each 64-bit draw is the splitmix64 finalizer applied to key + counter. A draw is cut into four 16-bit
+lanes and each lane is scaled into [1, 5] with a multiply-shift, so draw c yields ratings 4c through 4c + 3.
+No generator state is carried between calls, so any rank can produce any slice of any product and the
+result does not depend on who generated it.
+*/
+uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+uint64_t get_rating_stream_key(uint64_t seed, int product) {
+    return mix64(mix64(seed) ^ ((uint64_t)product * 0x9e3779b97f4a7c15ULL));
+}
+
+// Fills ratings with ratings first_index through first_index + count - 1 of the product's stream
+void get_ratings_from_stream(int *ratings, int count, uint64_t seed, int product, long long first_index) {
+    uint64_t key = get_rating_stream_key(seed, product);
+    uint64_t draw = mix64(key + (uint64_t)(first_index >> 2));
+    for (int i = 0; i < count; i++) {
+        long long index = first_index + i;
+        int lane = (int)(index & 3);
+        if (lane == 0 && i > 0) {
+            draw = mix64(key + (uint64_t)(index >> 2));
+        }
+        uint32_t bits = (uint32_t)(draw >> (16 * lane)) & 0xffff;
+        ratings[i] = (int)((bits * 5) >> 16) + 1;
+    }
+}
+
+// Same split as summation.c, over counts that may not fit in an int. Used for ranks and for threads
+void calculate_start_and_count(int rank, int size, long long n, long long *start, long long *count) {
+    long long elements_per_process = n / size;
+    long long remainder = n % size;
+    *start = rank * elements_per_process + (rank < remainder ? rank : remainder);
+    *count = elements_per_process + (rank < remainder ? 1 : 0);
+}
+
+int get_thread_index(void) {
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+int get_thread_count(void) {
+#ifdef _OPENMP
+    return omp_get_num_threads();
+#else
+    return 1;
+#endif
+}
+
+// Counter-based streams can be generated in any order, so each thread fills its own slice
+void get_ratings_from_stream_threaded(int *ratings, int count, uint64_t seed, int product, long long first_index) {
+    PROFILE_BEGIN(PROFILE_GENERATE);
+    #pragma omp parallel if (count >= THREADED_MIN_RATINGS)
+    {
+        long long start, slice;
+        calculate_start_and_count(get_thread_index(), get_thread_count(), count, &start, &slice);
+        get_ratings_from_stream(ratings + start, (int)slice, seed, product, first_index + start);
+    }
+    PROFILE_END(PROFILE_GENERATE);
+}
+
+// Generation of count ratings of a product starting at rating first_index, either from rand() or from the product's stream
+void get_product_ratings(struct Options *options, int *ratings, int product, long long first_index, int count) {
+    if (options->use_counter_rng) {
+        get_ratings_from_stream_threaded(ratings, count, options->seed, product, first_index);
+    } else {
+        get_ratings(ratings, count);
+    }
+}
+
+// Ratings of a product, n unless --skew gave the products their own counts
+long long get_product_rating_count(struct Options *options, int product) {
+    return options->product_ratings != NULL ? options->product_ratings[product - 1] : options->n;
+}
+
+// Zipf rating counts for --skew, product p's share of m * n is proportional to p^-skew
+long long *get_zipf_rating_counts(int m, long long n, double skew) {
+    long long *counts = (long long *)malloc(m * sizeof(long long));
+    double harmonic = 0.0;
+    for (int p = 1; p <= m; p++) {
+        harmonic += pow((double)p, -skew);
+    }
+    double total = (double)m * (double)n;
+    for (int p = 1; p <= m; p++) {
+        counts[p - 1] = llround(total * pow((double)p, -skew) / harmonic);
+        if (counts[p - 1] < 1) {
+            counts[p - 1] = 1;
+        }
+    }
+    return counts;
+}
+
+// Size of the pieces a product's n ratings are handled in
+int get_chunk_size(long long n) {
+    return n < MAX_RATINGS_PER_MESSAGE ? (int)n : MAX_RATINGS_PER_MESSAGE;
+}
+
+/*
+Histogram kernels.
+
+Ratings only take the values 1 through 5, so instead of summing them the kernels count them into a 5-bin
+histogram, which costs the same single pass over the ratings and keeps everything score_histogram needs.
+Each encoding has a portable scalar kernel and, on x86, AVX2 and AVX-512 versions compiled with target
+attributes so the file still builds without -mavx2. The SIMD kernels compare a vector of ratings against
+every value and count the matches in 8-bit (u8) or 32-bit (int) lanes, which are flushed into 64-bit
+counts before they can wrap. Packed words are counted with hardware popcount on their three bit planes.
+Every kernel adds to histogram[rating - 1] and ignores ratings outside 1..5. select_histogram_kernels picks
+one set at startup from what the CPU reports.
+*/
+// Bin of a scalar kernel: the rating itself, or 7 for anything above 7 (negative ints included), so bins 0, 6 and
+// 7 collect the ratings outside 1..5 and are never added to the histogram
+unsigned get_scalar_bin(unsigned rating) {
+    return rating < 7 ? rating : 7;
+}
+
+void histogram_int_ratings_scalar(const int *ratings, long long n, long long *histogram) {
+    // Four sets of bins so equal neighbouring ratings do not wait on each other's increments
+    long long bins[4][8] = {{0}};
+    long long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        bins[0][get_scalar_bin((unsigned)ratings[i])]++;
+        bins[1][get_scalar_bin((unsigned)ratings[i + 1])]++;
+        bins[2][get_scalar_bin((unsigned)ratings[i + 2])]++;
+        bins[3][get_scalar_bin((unsigned)ratings[i + 3])]++;
+    }
+    for (; i < n; i++) {
+        bins[0][get_scalar_bin((unsigned)ratings[i])]++;
+    }
+    for (int v = 0; v < RATING_VALUES; v++) {
+        histogram[v] += bins[0][v + 1] + bins[1][v + 1] + bins[2][v + 1] + bins[3][v + 1];
+    }
+}
+
+void histogram_u8_ratings_scalar(const uint8_t *ratings, long long n, long long *histogram) {
+    long long bins[4][8] = {{0}};
+    long long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        bins[0][get_scalar_bin(ratings[i])]++;
+        bins[1][get_scalar_bin(ratings[i + 1])]++;
+        bins[2][get_scalar_bin(ratings[i + 2])]++;
+        bins[3][get_scalar_bin(ratings[i + 3])]++;
+    }
+    for (; i < n; i++) {
+        bins[0][get_scalar_bin(ratings[i])]++;
+    }
+    for (int v = 0; v < RATING_VALUES; v++) {
+        histogram[v] += bins[0][v + 1] + bins[1][v + 1] + bins[2][v + 1] + bins[3][v + 1];
+    }
+}
+
+// A field holds value v when its three bits match v, so each value is one AND of the bit planes (inverted where v has a 0)
+void histogram_packed_ratings_scalar(const uint64_t *words, long long word_count, long long *histogram) {
+    for (long long w = 0; w < word_count; w++) {
+        uint64_t bit0 = words[w] & PACKED_LOW_BITS;
+        uint64_t bit1 = (words[w] >> 1) & PACKED_LOW_BITS;
+        uint64_t bit2 = (words[w] >> 2) & PACKED_LOW_BITS;
+        histogram[0] += __builtin_popcountll(bit0 & ~bit1 & ~bit2);
+        histogram[1] += __builtin_popcountll(~bit0 & bit1 & ~bit2);
+        histogram[2] += __builtin_popcountll(bit0 & bit1 & ~bit2);
+        histogram[3] += __builtin_popcountll(~bit0 & ~bit1 & bit2);
+        histogram[4] += __builtin_popcountll(bit0 & ~bit1 & bit2);
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+// Vector iterations between flushes, so a lane that matches on every iteration cannot wrap. The loops over the
+// values are unrolled so the RATING_VALUES counters stay in registers instead of an array on the stack
+#define U8_FLUSH_ITERATIONS 255
+#define INT_FLUSH_ITERATIONS (1 << 30)
+
+__attribute__((target("avx2"))) long long horizontal_sum_avx2(__m256i lanes) {
+    __m128i pair = _mm_add_epi64(_mm256_castsi256_si128(lanes), _mm256_extracti128_si256(lanes, 1));
+    return _mm_cvtsi128_si64(pair) + _mm_extract_epi64(pair, 1);
+}
+
+// Adds up eight 32-bit lanes holding up to INT_FLUSH_ITERATIONS each, widened so the total cannot overflow
+__attribute__((target("avx2"))) long long horizontal_sum_epi32_avx2(__m256i lanes) {
+    __m256i low = _mm256_cvtepu32_epi64(_mm256_castsi256_si128(lanes));
+    __m256i high = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(lanes, 1));
+    return horizontal_sum_avx2(_mm256_add_epi64(low, high));
+}
+
+// A match compares to all ones, so subtracting the comparison counts it
+__attribute__((target("avx2"))) void histogram_int_ratings_avx2(const int *ratings, long long n, long long *histogram) {
+    long long i = 0;
+    while (i + 8 <= n) {
+        long long block_end = n - i > 8LL * INT_FLUSH_ITERATIONS ? i + 8LL * INT_FLUSH_ITERATIONS : n;
+        __m256i counts[RATING_VALUES];
+        for (int v = 0; v < RATING_VALUES; v++) {
+            counts[v] = _mm256_setzero_si256();
+        }
+        for (; i + 8 <= block_end; i += 8) {
+            __m256i values = _mm256_loadu_si256((const __m256i *)(ratings + i));
+            #pragma GCC unroll 5
+            for (int v = 0; v < RATING_VALUES; v++) {
+                counts[v] = _mm256_sub_epi32(counts[v], _mm256_cmpeq_epi32(values, _mm256_set1_epi32(v + 1)));
+            }
+        }
+        for (int v = 0; v < RATING_VALUES; v++) {
+            histogram[v] += horizontal_sum_epi32_avx2(counts[v]);
+        }
+    }
+    histogram_int_ratings_scalar(ratings + i, n - i, histogram);
+}
+
+// Byte counters are folded into 64-bit lanes with the SAD instruction every U8_FLUSH_ITERATIONS vectors
+__attribute__((target("avx2"))) void histogram_u8_ratings_avx2(const uint8_t *ratings, long long n, long long *histogram) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i totals[RATING_VALUES];
+    for (int v = 0; v < RATING_VALUES; v++) {
+        totals[v] = zero;
+    }
+    long long i = 0;
+    while (i + 32 <= n) {
+        __m256i counts[RATING_VALUES];
+        for (int v = 0; v < RATING_VALUES; v++) {
+            counts[v] = zero;
+        }
+        for (int j = 0; j < U8_FLUSH_ITERATIONS && i + 32 <= n; j++, i += 32) {
+            __m256i values = _mm256_loadu_si256((const __m256i *)(ratings + i));
+            #pragma GCC unroll 5
+            for (int v = 0; v < RATING_VALUES; v++) {
+                counts[v] = _mm256_sub_epi8(counts[v], _mm256_cmpeq_epi8(values, _mm256_set1_epi8((char)(v + 1))));
+            }
+        }
+        for (int v = 0; v < RATING_VALUES; v++) {
+            totals[v] = _mm256_add_epi64(totals[v], _mm256_sad_epu8(counts[v], zero));
+        }
+    }
+    for (int v = 0; v < RATING_VALUES; v++) {
+        histogram[v] += horizontal_sum_avx2(totals[v]);
+    }
+    histogram_u8_ratings_scalar(ratings + i, n - i, histogram);
+}
+
+__attribute__((target("popcnt"))) void histogram_packed_ratings_popcnt(const uint64_t *words, long long word_count, long long *histogram) {
+    for (long long w = 0; w < word_count; w++) {
+        uint64_t bit0 = words[w] & PACKED_LOW_BITS;
+        uint64_t bit1 = (words[w] >> 1) & PACKED_LOW_BITS;
+        uint64_t bit2 = (words[w] >> 2) & PACKED_LOW_BITS;
+        histogram[0] += __builtin_popcountll(bit0 & ~bit1 & ~bit2);
+        histogram[1] += __builtin_popcountll(~bit0 & bit1 & ~bit2);
+        histogram[2] += __builtin_popcountll(bit0 & bit1 & ~bit2);
+        histogram[3] += __builtin_popcountll(~bit0 & ~bit1 & bit2);
+        histogram[4] += __builtin_popcountll(bit0 & ~bit1 & bit2);
+    }
+}
+
+// AVX-512 compares produce masks, matches are counted with a masked add of one
+__attribute__((target("avx512f"))) void histogram_int_ratings_avx512(const int *ratings, long long n, long long *histogram) {
+    __m512i one = _mm512_set1_epi32(1);
+    long long i = 0;
+    while (i + 16 <= n) {
+        long long block_end = n - i > 16LL * INT_FLUSH_ITERATIONS ? i + 16LL * INT_FLUSH_ITERATIONS : n;
+        __m512i counts[RATING_VALUES];
+        for (int v = 0; v < RATING_VALUES; v++) {
+            counts[v] = _mm512_setzero_si512();
+        }
+        for (; i + 16 <= block_end; i += 16) {
+            __m512i values = _mm512_loadu_si512((const void *)(ratings + i));
+            #pragma GCC unroll 5
+            for (int v = 0; v < RATING_VALUES; v++) {
+                __mmask16 matches = _mm512_cmpeq_epi32_mask(values, _mm512_set1_epi32(v + 1));
+                counts[v] = _mm512_mask_add_epi32(counts[v], matches, counts[v], one);
+            }
+        }
+        for (int v = 0; v < RATING_VALUES; v++) {
+            __m512i low = _mm512_cvtepu32_epi64(_mm512_castsi512_si256(counts[v]));
+            __m512i high = _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(counts[v], 1));
+            histogram[v] += _mm512_reduce_add_epi64(_mm512_add_epi64(low, high));
+        }
+    }
+    histogram_int_ratings_scalar(ratings + i, n - i, histogram);
+}
+
+__attribute__((target("avx512f,avx512bw"))) void histogram_u8_ratings_avx512(const uint8_t *ratings, long long n, long long *histogram) {
+    __m512i zero = _mm512_setzero_si512();
+    __m512i one = _mm512_set1_epi8(1);
+    __m512i totals[RATING_VALUES];
+    for (int v = 0; v < RATING_VALUES; v++) {
+        totals[v] = zero;
+    }
+    long long i = 0;
+    while (i + 64 <= n) {
+        __m512i counts[RATING_VALUES];
+        for (int v = 0; v < RATING_VALUES; v++) {
+            counts[v] = zero;
+        }
+        for (int j = 0; j < U8_FLUSH_ITERATIONS && i + 64 <= n; j++, i += 64) {
+            __m512i values = _mm512_loadu_si512((const void *)(ratings + i));
+            #pragma GCC unroll 5
+            for (int v = 0; v < RATING_VALUES; v++) {
+                __mmask64 matches = _mm512_cmpeq_epi8_mask(values, _mm512_set1_epi8((char)(v + 1)));
+                counts[v] = _mm512_mask_add_epi8(counts[v], matches, counts[v], one);
+            }
+        }
+        for (int v = 0; v < RATING_VALUES; v++) {
+            totals[v] = _mm512_add_epi64(totals[v], _mm512_sad_epu8(counts[v], zero));
+        }
+    }
+    for (int v = 0; v < RATING_VALUES; v++) {
+        histogram[v] += _mm512_reduce_add_epi64(totals[v]);
+    }
+    histogram_u8_ratings_scalar(ratings + i, n - i, histogram);
+}
+#endif
+
+struct HistogramKernels {
+    const char *name;
+    void (*histogram_int)(const int *ratings, long long n, long long *histogram);
+    void (*histogram_u8)(const uint8_t *ratings, long long n, long long *histogram);
+    void (*histogram_packed)(const uint64_t *words, long long word_count, long long *histogram);
+};
+
+struct HistogramKernels histogram_kernels = {"scalar", histogram_int_ratings_scalar, histogram_u8_ratings_scalar, histogram_packed_ratings_scalar};
+
+// Fills kernels with the requested set, returns 1 when this CPU (or build) cannot run it
+int get_histogram_kernels(enum Kernel kernel, struct HistogramKernels *kernels) {
+    struct HistogramKernels scalar = {"scalar", histogram_int_ratings_scalar, histogram_u8_ratings_scalar, histogram_packed_ratings_scalar};
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt")) {
+        scalar.histogram_packed = histogram_packed_ratings_popcnt;
+    }
+    int has_avx2 = __builtin_cpu_supports("avx2");
+    int has_avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+
+    if (kernel == KERNEL_AUTO) {
+        kernel = has_avx512 ? KERNEL_AVX512 : (has_avx2 ? KERNEL_AVX2 : KERNEL_SCALAR);
+    }
+    if (kernel == KERNEL_AVX512) {
+        struct HistogramKernels avx512 = {"avx512", histogram_int_ratings_avx512, histogram_u8_ratings_avx512, scalar.histogram_packed};
+        *kernels = avx512;
+        return !has_avx512;
+    } else if (kernel == KERNEL_AVX2) {
+        struct HistogramKernels avx2 = {"avx2", histogram_int_ratings_avx2, histogram_u8_ratings_avx2, scalar.histogram_packed};
+        *kernels = avx2;
+        return !has_avx2;
+    }
+#endif
+    *kernels = scalar;
+    return kernel != KERNEL_AUTO && kernel != KERNEL_SCALAR;
+}
+
+int select_histogram_kernels(enum Kernel kernel) {
+    struct HistogramKernels kernels;
+    if (get_histogram_kernels(kernel, &kernels)) {
+        return 1;
+    }
+    histogram_kernels = kernels;
+    return 0;
+}
+
+/*
+Statistics from a histogram.
+
+With the ratings sorted, the ones equal to v occupy the positions after the histogram counts of 1 through
+v - 1, so any order statistic is found by walking the five counts: the median is exact (the mean of the two
+middle ratings for an even count) and percentiles use the nearest rank. The Bayesian average adds
+prior_weight pretend ratings of prior_mean, pulling products with few ratings towards the prior so one
+5-star rating does not outrank thousands of 4.9s.
+*/
+
+// Rating at position index (from 0) of the product's sorted ratings
+int get_sorted_rating(const long long *histogram, long long index) {
+    for (int v = 0; v < RATING_VALUES; v++) {
+        if (index < histogram[v]) {
+            return v + 1;
+        }
+        index -= histogram[v];
+    }
+    return RATING_VALUES;
+}
+
+// Nearest-rank percentile: the smallest rating with at least percent% of the ratings at or below it
+int get_rating_percentile(const long long *histogram, long long count, int percent) {
+    long long rank = (percent * count + 99) / 100;
+    return get_sorted_rating(histogram, rank > 0 ? rank - 1 : 0);
+}
+
+// Fills every statistic of result from the product's histogram and sets its score to the --rank-by key
+void score_histogram(struct Options *options, const long long *histogram, int rank, int product, struct RatingToRank *result) {
+    long long count = 0;
+    long long sum = 0;
+    for (int v = 0; v < RATING_VALUES; v++) {
+        count += histogram[v];
+        sum += (v + 1) * histogram[v];
+    }
+
+    result->rank = rank;
+    result->product = product;
+    result->rating_count = count;
+    double weight = options->prior_weight + count;
+    result->bayesian_average = weight > 0 ? (options->prior_mean * options->prior_weight + sum) / weight : 0.0;
+    if (count == 0) {
+        result->average_rating = result->variance = result->median = 0.0;
+        result->percentile_25 = result->percentile_75 = 0.0;
+    } else {
+        double mean = (double)sum / count;
+        double squares = 0.0;
+        for (int v = 0; v < RATING_VALUES; v++) {
+            squares += histogram[v] * (v + 1 - mean) * (v + 1 - mean);
+        }
+        result->average_rating = mean;
+        result->variance = squares / count;
+        result->median = (get_sorted_rating(histogram, (count - 1) / 2) + get_sorted_rating(histogram, count / 2)) / 2.0;
+        result->percentile_25 = get_rating_percentile(histogram, count, 25);
+        result->percentile_75 = get_rating_percentile(histogram, count, 75);
+    }
+
+    if (options->rank_by == RANK_BY_BAYESIAN) {
+        result->score = result->bayesian_average;
+    } else if (options->rank_by == RANK_BY_MEDIAN) {
+        result->score = result->median;
+    } else if (options->rank_by == RANK_BY_PERCENTILE_25) {
+        result->score = result->percentile_25;
+    } else if (options->rank_by == RANK_BY_PERCENTILE_75) {
+        result->score = result->percentile_75;
+    } else {
+        result->score = result->average_rating;
     }
-    return (double)sum / n;
 }
 
-void merge(struct RatingToRank *ratings_to_rank_averages, int left, int middle, int right) {
+// scratch must hold right - left + 1 elements, it is shared by every merge of one sort
+void merge(struct RatingToRank *ratings_to_rank_averages, struct RatingToRank *scratch, int left, int middle, int right) {
     int n1 = middle - left + 1;
     int n2 = right - middle;
 
-    struct RatingToRank *left_array = (struct RatingToRank *)malloc(n1 * sizeof(struct RatingToRank));
-    struct RatingToRank *right_array = (struct RatingToRank *)malloc(n2 * sizeof(struct RatingToRank));
+    // Both halves are copied into the one scratch buffer instead of two fresh allocations per merge
+    struct RatingToRank *left_array = scratch;
+    struct RatingToRank *right_array = scratch + n1;
 
     for (int i = 0; i < n1; i++) {
         left_array[i] = ratings_to_rank_averages[left + i];
@@ -93,9 +1017,9 @@ void merge(struct RatingToRank *ratings_to_rank_averages, int left, int middle,
     int j = 0;
     int k = left;
 
-    // Sort in descending order
+    // Sort in descending order, ties go to the lower product index
     while (i < n1 && j < n2) {
-        if (left_array[i].average_rating >= right_array[j].average_rating) {
+        if (!is_better_rating(&right_array[j], &left_array[i])) {
             ratings_to_rank_averages[k] = left_array[i];
             i++;
         } else {
@@ -116,139 +1040,2645 @@ void merge(struct RatingToRank *ratings_to_rank_averages, int left, int middle,
         j++;
         k++;
     }
-
-    free(left_array);
-    free(right_array);
 }
 
-void merge_sort(struct RatingToRank *ratings_to_rank_averages, int left, int right) {
+void merge_sort(struct RatingToRank *ratings_to_rank_averages, struct RatingToRank *scratch, int left, int right) {
     if (left < right) {
         int middle = left + (right - left) / 2; // find middle point
-        merge_sort(ratings_to_rank_averages, left, middle); // recursively sort left half
-        merge_sort(ratings_to_rank_averages, middle + 1, right); // recursively sort right half
-        merge(ratings_to_rank_averages, left, middle, right); // merge sorted halves
+        merge_sort(ratings_to_rank_averages, scratch, left, middle); // recursively sort left half
+        merge_sort(ratings_to_rank_averages, scratch, middle + 1, right); // recursively sort right half
+        merge(ratings_to_rank_averages, scratch, left, middle, right); // merge sorted halves
     }
 }
 
+// One scratch allocation per sort, reused by every merge step
 void sort(struct RatingToRank *ratings_to_rank_averages, int m) {
-    return merge_sort(ratings_to_rank_averages, 0, m - 1);
+    if (m < 2) {
+        return;
+    }
+    struct RatingToRank *scratch = (struct RatingToRank *)malloc(m * sizeof(struct RatingToRank));
+    merge_sort(ratings_to_rank_averages, scratch, 0, m - 1);
+    free(scratch);
 }
 
-int is_argument_error(int argc, char **argv, int rank, int size, int m, int n) {
-    if (argc != 3) {
-        if (rank == 0) {
-            printf("Ensure to enter an m and n as command line arguments, m is the number of products to be rated and n is the number of ratings for each product.\n");
-        }
-        MPI_Finalize();
-        return 1;
-    } else if (m > size - 1) {
-        if (rank == 0) {
-            printf("m cannot be greater than the number of cores minus 1. Number of cores: %d\n", size);
-        }
-        MPI_Finalize();
-        return 1;
-    } else if(n < 5) {
-        if (rank == 0) {
-            printf("n must be greater than 5\n");
-        }
-        MPI_Finalize();
-        return 1;
-    } else if (n > 1000000) {
-        if (rank == 0) {
-            printf("n must be less than 1,000,000\n");
+/*
+Top-K ranking.
+
+keep_top_k selects the k best results with a min-heap of size k kept in the front of the array (the worst
+of the current top k sits at the root), which is O(count log k) and needs no extra memory, then sorts just
+those k. gather_top_k runs it on every rank, gathers the k-long lists with MPI_Gatherv and has rank 0 merge
+the sorted lists with a heap over the list heads, so rank 0 handles k * ranks results instead of m.
+*/
+void swap_ratings(struct RatingToRank *a, struct RatingToRank *b) {
+    struct RatingToRank temporary = *a;
+    *a = *b;
+    *b = temporary;
+}
+
+// Restores the heap below index, heap[0] is the worst of the heap
+void sift_down_worst(struct RatingToRank *heap, int count, int index) {
+    while (1) {
+        int worst = index;
+        int left = 2 * index + 1;
+        int right = left + 1;
+        if (left < count && is_better_rating(&heap[worst], &heap[left])) {
+            worst = left;
         }
-        MPI_Finalize();
-        return 1;
-    } else if (m < 1) {
-        if (rank == 0) {
-            printf("m must be greater than 0\n");
+        if (right < count && is_better_rating(&heap[worst], &heap[right])) {
+            worst = right;
         }
-        MPI_Finalize();
-        return 1;
-    } else if (n < 1) {
-        if (rank == 0) {
-            printf("n must be greater than 0\n");
+        if (worst == index) {
+            return;
         }
-        MPI_Finalize();
-        return 1;
-    } else {
-        return 0;
+        swap_ratings(&heap[index], &heap[worst]);
+        index = worst;
     }
 }
 
-int main(int argc, char **argv) {
-    setlocale(LC_ALL, "");
-
-    int m, n, rank, size;
-    MPI_Init(&argc, &argv);
-    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-    MPI_Comm_size(MPI_COMM_WORLD, &size);
+// Moves the k best results to the front, best first, and returns how many there are
+int keep_top_k(struct RatingToRank *results, int count, int k) {
+    PROFILE_BEGIN(PROFILE_SORT);
+    if (k >= count) {
+        sort(results, count);
+        PROFILE_END(PROFILE_SORT);
+        return count;
+    }
 
-    // Parse command line arguments
-    m = atoi(argv[1]);
-    n = atoi(argv[2]);
+    for (int i = k / 2 - 1; i >= 0; i--) {
+        sift_down_worst(results, k, i);
+    }
+    for (int i = k; i < count; i++) {
+        if (is_better_rating(&results[i], &results[0])) {
+            results[0] = results[i];
+            sift_down_worst(results, k, 0);
+        }
+    }
+
+    sort(results, k);
+    PROFILE_END(PROFILE_SORT);
+    return k;
+}
+
+// Heap over the heads of the gathered per-rank lists, used by the K-way merge in gather_top_k
+struct ListHeads {
+    struct RatingToRank *lists;
+    int *displacements; // start of each rank's list in lists
+    int *positions;     // next unmerged element of each rank's list
+    int *ranks;         // heap of ranks whose lists are not exhausted
+    int count;
+};
+
+struct RatingToRank *get_list_head(struct ListHeads *heads, int index) {
+    int r = heads->ranks[index];
+    return &heads->lists[heads->displacements[r] + heads->positions[r]];
+}
+
+void sift_down_best_head(struct ListHeads *heads, int index) {
+    while (1) {
+        int best = index;
+        int left = 2 * index + 1;
+        int right = left + 1;
+        if (left < heads->count && is_better_rating(get_list_head(heads, left), get_list_head(heads, best))) {
+            best = left;
+        }
+        if (right < heads->count && is_better_rating(get_list_head(heads, right), get_list_head(heads, best))) {
+            best = right;
+        }
+        if (best == index) {
+            return;
+        }
+        int temporary = heads->ranks[index];
+        heads->ranks[index] = heads->ranks[best];
+        heads->ranks[best] = temporary;
+        index = best;
+    }
+}
+
+/*
+Collective over MPI_COMM_WORLD. Every rank passes its results (reordered in place), rank 0 receives the
+overall top k in top, best first, and the return value is how many it got. Other ranks get 0.
+*/
+int gather_top_k(struct RatingToRank *local_results, int local_count, int k, int rank, int size, struct RatingToRank *top) {
+    local_count = keep_top_k(local_results, local_count, k);
+
+    int *counts = NULL;
+    int *displacements = NULL;
+    struct RatingToRank *lists = NULL;
+    int total = 0;
+    if (rank == 0) {
+        counts = (int *)malloc(size * sizeof(int));
+        displacements = (int *)malloc(size * sizeof(int));
+    }
+    PROFILE_BEGIN(PROFILE_COLLECTIVE);
+    MPI_Gather(&local_count, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    PROFILE_END(PROFILE_COLLECTIVE);
+    if (rank == 0) {
+        for (int r = 0; r < size; r++) {
+            displacements[r] = total;
+            total += counts[r];
+        }
+        lists = (struct RatingToRank *)malloc((total > 0 ? total : 1) * sizeof(struct RatingToRank));
+    }
+    PROFILE_BEGIN(PROFILE_COLLECTIVE);
+    MPI_Gatherv(local_results, local_count, rating_to_rank_type, lists, counts, displacements, rating_to_rank_type, 0, MPI_COMM_WORLD);
+    PROFILE_END(PROFILE_COLLECTIVE);
+    PROFILE_SEND(local_count * sizeof(struct RatingToRank));
+
+    if (rank != 0) {
+        return 0;
+    }
+
+    // K-way merge: heads holds the ranks whose lists still have elements, best head at the root
+    struct ListHeads heads;
+    heads.lists = lists;
+    heads.displacements = displacements;
+    heads.positions = (int *)calloc(size, sizeof(int));
+    heads.ranks = (int *)malloc(size * sizeof(int));
+    heads.count = 0;
+    for (int r = 0; r < size; r++) {
+        if (counts[r] > 0) {
+            heads.ranks[heads.count++] = r;
+        }
+    }
+    for (int i = heads.count / 2 - 1; i >= 0; i--) {
+        sift_down_best_head(&heads, i);
+    }
+
+    int top_count = 0;
+    while (top_count < k && heads.count > 0) {
+        int r = heads.ranks[0];
+        top[top_count++] = *get_list_head(&heads, 0);
+        heads.positions[r]++;
+        if (heads.positions[r] == counts[r]) {
+            heads.ranks[0] = heads.ranks[--heads.count];
+        }
+        sift_down_best_head(&heads, 0);
+    }
+
+    free(heads.ranks);
+    free(heads.positions);
+    free(lists);
+    free(counts);
+    free(displacements);
+    return top_count;
+}
+
+/*
+Parallel file input.
+
+The file is cut into one contiguous byte range per rank and each rank reads its range with collective
+MPI-IO calls, counting every rating it sees into its product's histogram. The partial histograms are
+combined on rank 0 with MPI_Reduce, so the only data rank 0 receives is O(m) no matter how large the file is.
+*/
+
+// Byte-at-a-time CSV state so records split across blocks (or across ranks) need no copying
+struct CsvParser {
+    long long offset;     // file offset of the next byte fed to the parser
+    long long range_end;  // lines starting at or past this offset belong to the next rank
+    long long line_start; // file offset where the current line started
+    int skipping;         // 1 while skipping the partial line the previous rank owns
+    int done;             // 1 once a line starting at or past range_end is reached
+    int field;            // 0 while reading the product, 1 while reading the rating
+    int digits[2];        // digits seen in each field
+    long long values[2];  // product and rating being parsed
+    int malformed;        // 1 when the current line has already failed to parse
+};
+
+// histograms holds RATING_VALUES bins per product
+void add_rating(int m, long long product, long long rating, long long *histograms, long long *skipped) {
+    if (product < 1 || product > m || rating < 1 || rating > RATING_VALUES) {
+        (*skipped)++;
+        return;
+    }
+    histograms[(product - 1) * RATING_VALUES + rating - 1]++;
+}
+
+void csv_end_line(struct CsvParser *parser, int m, long long *histograms, long long *skipped) {
+    int is_empty = parser->field == 0 && parser->digits[0] == 0 && !parser->malformed;
+    if (!is_empty) {
+        if (parser->malformed || parser->field != 1 || parser->digits[0] == 0 || parser->digits[1] == 0) {
+            (*skipped)++;
+        } else {
+            add_rating(m, parser->values[0], parser->values[1], histograms, skipped);
+        }
+    }
+    parser->field = 0;
+    parser->digits[0] = parser->digits[1] = 0;
+    parser->values[0] = parser->values[1] = 0;
+    parser->malformed = 0;
+}
+
+void csv_feed(struct CsvParser *parser, const char *bytes, long long length, int m, long long *histograms, long long *skipped) {
+    for (long long i = 0; i < length && !parser->done; i++) {
+        char c = bytes[i];
+        parser->offset++;
+
+        if (c == '\n') {
+            if (parser->skipping) {
+                parser->skipping = 0;
+            } else {
+                csv_end_line(parser, m, histograms, skipped);
+            }
+            parser->line_start = parser->offset;
+            if (parser->line_start >= parser->range_end) {
+                parser->done = 1;
+            }
+        } else if (parser->skipping || parser->malformed) {
+            continue;
+        } else if (c >= '0' && c <= '9') {
+            if (parser->digits[parser->field] < 18) {
+                parser->values[parser->field] = parser->values[parser->field] * 10 + (c - '0');
+            }
+            parser->digits[parser->field]++;
+        } else if (c == ',' && parser->field == 0) {
+            parser->field = 1;
+        } else if (c != ' ' && c != '\t' && c != '\r') {
+            parser->malformed = 1;
+        }
+    }
+}
+
+// Returns 0 on success. Collective over MPI_COMM_WORLD, rank 0 receives every product's statistics
+int read_ratings_file(struct Options *options, int rank, int size, struct RatingToRank *ratings_to_rank_averages) {
+    int m = options->m;
+    MPI_File file;
+    if (MPI_File_open(MPI_COMM_WORLD, options->input_path, MPI_MODE_RDONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS) {
+        if (rank == 0) {
+            printf("Could not open input file %s\n", options->input_path);
+        }
+        return 1;
+    }
+
+    MPI_Offset file_size;
+    MPI_File_get_size(file, &file_size);
+
+    long long data_bytes = file_size;
+    if (options->input_format == INPUT_BINARY) {
+        data_bytes = (long long)m * options->n;
+        if (file_size < data_bytes) {
+            if (rank == 0) {
+                printf("Input file %s holds %lld bytes but m * n = %lld ratings were requested\n", options->input_path, (long long)file_size, data_bytes);
+            }
+            MPI_File_close(&file);
+            return 1;
+        }
+    }
+
+    long long start, count;
+    calculate_start_and_count(rank, size, data_bytes, &start, &count);
+    long long end = start + count;
+
+    long long *histograms = (long long *)calloc((size_t)m * RATING_VALUES, sizeof(long long));
+    long long skipped = 0;
+    char *block = (char *)malloc(INPUT_BLOCK_BYTES);
+
+    // A CSV rank also reads the byte before its range to know whether its first line starts on the boundary
+    long long read_start = start;
+    struct CsvParser parser = {0};
+    if (options->input_format == INPUT_CSV) {
+        read_start = start > 0 ? start - 1 : 0;
+        parser.offset = read_start;
+        parser.range_end = end;
+        parser.line_start = start;
+        parser.skipping = start > 0;
+        parser.done = count == 0;
+    }
+
+    // Collective reads must be called the same number of times on every rank
+    long long read_bytes = end - read_start;
+    long long my_blocks = (read_bytes + INPUT_BLOCK_BYTES - 1) / INPUT_BLOCK_BYTES;
+    long long blocks;
+    MPI_Allreduce(&my_blocks, &blocks, 1, MPI_LONG_LONG, MPI_MAX, MPI_COMM_WORLD);
+
+    for (long long b = 0; b < blocks; b++) {
+        long long block_offset = read_start + b * INPUT_BLOCK_BYTES;
+        long long remaining = end - block_offset;
+        int block_bytes = remaining <= 0 ? 0 : (remaining < INPUT_BLOCK_BYTES ? (int)remaining : INPUT_BLOCK_BYTES);
+
+        PROFILE_BEGIN(PROFILE_READ);
+        MPI_File_read_at_all(file, block_offset, block, block_bytes, MPI_BYTE, MPI_STATUS_IGNORE);
+        PROFILE_END(PROFILE_READ);
+
+        if (options->input_format == INPUT_CSV) {
+            csv_feed(&parser, block, block_bytes, m, histograms, &skipped);
+        } else {
+            long long n = options->n;
+            for (int i = 0; i < block_bytes; i++) {
+                long long product = (block_offset + i) / n + 1;
+                add_rating(m, product, (unsigned char)block[i], histograms, &skipped);
+            }
+        }
+    }
+
+    // Finish the last line, which may run past the end of this rank's range
+    if (options->input_format == INPUT_CSV) {
+        long long tail_offset = end;
+        while (!parser.done && tail_offset < file_size) {
+            int tail_bytes = file_size - tail_offset < INPUT_TAIL_BYTES ? (int)(file_size - tail_offset) : INPUT_TAIL_BYTES;
+            PROFILE_BEGIN(PROFILE_READ);
+            MPI_File_read_at(file, tail_offset, block, tail_bytes, MPI_BYTE, MPI_STATUS_IGNORE);
+            PROFILE_END(PROFILE_READ);
+            csv_feed(&parser, block, tail_bytes, m, histograms, &skipped);
+            tail_offset += tail_bytes;
+        }
+        if (!parser.done && !parser.skipping) {
+            csv_end_line(&parser, m, histograms, &skipped); // last line of the file has no newline
+        }
+    }
+
+    MPI_File_close(&file);
+    free(block);
+
+    long long *total_histograms = rank == 0 ? (long long *)malloc((size_t)m * RATING_VALUES * sizeof(long long)) : NULL;
+    long long total_skipped = 0;
+    PROFILE_BEGIN(PROFILE_COLLECTIVE);
+    MPI_Reduce(histograms, total_histograms, m * RATING_VALUES, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&skipped, &total_skipped, 1, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    PROFILE_END(PROFILE_COLLECTIVE);
+    PROFILE_SEND(((long long)m * RATING_VALUES + 1) * sizeof(long long));
+
+    if (rank == 0) {
+        for (int i = 0; i < m; i++) {
+            score_histogram(options, total_histograms + (size_t)i * RATING_VALUES, 0, i + 1, &ratings_to_rank_averages[i]);
+        }
+        if (total_skipped > 0) {
+            printf("Skipped %lld malformed or out of range records\n", total_skipped);
+        }
+        free(total_histograms);
+    }
+
+    free(histograms);
+    return 0;
+}
+
+/*
+Wire encodings for the master -> worker transfer.
+
+A rating only needs 3 bits, so besides the original int array the ratings can travel as one byte each or
+bit-packed 21 to a 64-bit word. The worker never expands the compact forms back into ints: the u8 form is
+counted byte by byte, and in the packed form the fields holding value v are found by ANDing the word's three
+bit planes (each inverted where v has a 0 bit) and counted with popcount. Unused fields in the last word are
+zero, which no rating is.
+*/
+MPI_Datatype get_encoding_datatype(enum Encoding encoding) {
+    if (encoding == ENCODING_U8) {
+        return MPI_UINT8_T;
+    } else if (encoding == ENCODING_PACKED) {
+        return MPI_UINT64_T;
+    }
+    return MPI_INT;
+}
+
+size_t get_encoding_element_bytes(enum Encoding encoding) {
+    if (encoding == ENCODING_U8) {
+        return sizeof(uint8_t);
+    } else if (encoding == ENCODING_PACKED) {
+        return sizeof(uint64_t);
+    }
+    return sizeof(int);
+}
+
+// Number of wire elements (of get_encoding_datatype) needed for n ratings
+int get_encoded_count(enum Encoding encoding, int n) {
+    if (encoding == ENCODING_PACKED) {
+        return (n + RATINGS_PER_PACKED_WORD - 1) / RATINGS_PER_PACKED_WORD;
+    }
+    return n;
+}
+
+size_t get_encoded_bytes(enum Encoding encoding, int n) {
+    return (size_t)get_encoded_count(encoding, n) * get_encoding_element_bytes(encoding);
+}
+
+/*
+Buffers for moving a product's ratings one chunk at a time.
+
+ratings holds a chunk as ints and wire holds encoded chunks. For the int encoding wire[0] is the ratings
+array itself. The blocking path only uses wire[0]. The pipelined path alternates between wire[0] and
+wire[1], each with its own request, so one chunk can be in flight while the other is filled or counted.
+*/
+struct RatingBuffers {
+    int *ratings;
+    void *wire[2];
+    MPI_Request requests[2];
+    int next; // wire buffer the next chunk goes through
+};
+
+void allocate_rating_buffers(struct Options *options, struct RatingBuffers *buffers) {
+    size_t wire_bytes = get_encoded_bytes(options->encoding, options->chunk_size);
+    buffers->ratings = (int *)malloc(options->chunk_size * sizeof(int));
+    buffers->wire[0] = options->encoding == ENCODING_INT ? buffers->ratings : malloc(wire_bytes);
+    buffers->wire[1] = options->pipeline ? malloc(wire_bytes) : NULL;
+    buffers->requests[0] = buffers->requests[1] = MPI_REQUEST_NULL;
+    buffers->next = 0;
+}
+
+// Completes any send still in flight before releasing the buffers
+void free_rating_buffers(struct RatingBuffers *buffers) {
+    MPI_Waitall(2, buffers->requests, MPI_STATUSES_IGNORE);
+    if (buffers->wire[0] != buffers->ratings) {
+        free(buffers->wire[0]);
+    }
+    free(buffers->wire[1]);
+    free(buffers->ratings);
+}
+
+// Number of ratings in the chunk that starts at rating first of a product with n ratings
+int get_chunk_count(long long n, long long first, int chunk_size) {
+    return n - first < chunk_size ? (int)(n - first) : chunk_size;
+}
+
+void encode_ratings(enum Encoding encoding, const int *ratings, int n, void *wire) {
+    PROFILE_BEGIN(PROFILE_ENCODE);
+    if (encoding == ENCODING_U8) {
+        uint8_t *bytes = (uint8_t *)wire;
+        for (int i = 0; i < n; i++) {
+            bytes[i] = (uint8_t)ratings[i];
+        }
+    } else if (encoding == ENCODING_PACKED) {
+        uint64_t *words = (uint64_t *)wire;
+        int word_count = get_encoded_count(encoding, n);
+        for (int w = 0; w < word_count; w++) {
+            uint64_t word = 0;
+            int first = w * RATINGS_PER_PACKED_WORD;
+            int last = first + RATINGS_PER_PACKED_WORD < n ? first + RATINGS_PER_PACKED_WORD : n;
+            for (int i = first; i < last; i++) {
+                word |= (uint64_t)ratings[i] << (PACKED_FIELD_BITS * (i - first));
+            }
+            words[w] = word;
+        }
+    }
+    PROFILE_END(PROFILE_ENCODE);
+}
+
+// Adds the chunk's ratings to histogram
+void histogram_encoded_ratings(enum Encoding encoding, const void *wire, long long n, long long *histogram) {
+    if (encoding == ENCODING_U8) {
+        histogram_kernels.histogram_u8((const uint8_t *)wire, n, histogram);
+    } else if (encoding == ENCODING_PACKED) {
+        histogram_kernels.histogram_packed((const uint64_t *)wire, get_encoded_count(encoding, n), histogram);
+    } else {
+        histogram_kernels.histogram_int((const int *)wire, n, histogram);
+    }
+}
+
+// Each thread runs the kernel over its own slice of the encoded chunk into its own histogram and the histograms are added up
+void histogram_encoded_ratings_threaded(enum Encoding encoding, const void *wire, int n, long long *histogram) {
+    PROFILE_BEGIN(PROFILE_HISTOGRAM);
+    #pragma omp parallel reduction(+:histogram[:RATING_VALUES]) if (n >= THREADED_MIN_RATINGS)
+    {
+        // Packed words cannot be split, so slices are whole wire elements
+        long long units = get_encoded_count(encoding, n);
+        long long start, count;
+        calculate_start_and_count(get_thread_index(), get_thread_count(), units, &start, &count);
+        if (encoding == ENCODING_U8) {
+            histogram_kernels.histogram_u8((const uint8_t *)wire + start, count, histogram);
+        } else if (encoding == ENCODING_PACKED) {
+            histogram_kernels.histogram_packed((const uint64_t *)wire + start, count, histogram);
+        } else {
+            histogram_kernels.histogram_int((const int *)wire + start, count, histogram);
+        }
+    }
+    PROFILE_END(PROFILE_HISTOGRAM);
+}
+
+/*
+Master side: generate one product's ratings and send them to dest in the selected encoding, one chunk per
+message. With --pipeline the chunk is sent with MPI_Isend and the next chunk is generated into the other
+wire buffer while it travels, the only wait is for the send that last used that buffer.
+*/
+void send_product_ratings(struct Options *options, struct RatingBuffers *buffers, int product, int dest) {
+    long long n = get_product_rating_count(options, product);
+    int chunk_size = options->chunk_size;
+    enum Encoding encoding = options->encoding;
+    for (long long first = 0; first < n; first += chunk_size) {
+        int count = get_chunk_count(n, first, chunk_size);
+        int b = buffers->next;
+        if (options->pipeline) {
+            PROFILE_BEGIN(PROFILE_SEND);
+            MPI_Wait(&buffers->requests[b], MPI_STATUS_IGNORE);
+            PROFILE_END(PROFILE_SEND);
+            buffers->next = 1 - b;
+        }
+
+        // Int chunks are generated straight into the wire buffer, the compact encodings are packed from ratings
+        int *chunk = encoding == ENCODING_INT ? (int *)buffers->wire[b] : buffers->ratings;
+        get_product_ratings(options, chunk, product, first, count);
+        encode_ratings(encoding, chunk, count, buffers->wire[b]);
+
+        PROFILE_BEGIN(PROFILE_SEND);
+        if (options->pipeline) {
+            MPI_Isend(buffers->wire[b], get_encoded_count(encoding, count), get_encoding_datatype(encoding), dest, TAG_RATINGS, MPI_COMM_WORLD, &buffers->requests[b]);
+        } else {
+            MPI_Send(buffers->wire[b], get_encoded_count(encoding, count), get_encoding_datatype(encoding), dest, TAG_RATINGS, MPI_COMM_WORLD);
+        }
+        PROFILE_END(PROFILE_SEND);
+        PROFILE_SEND(get_encoded_bytes(encoding, count));
+    }
+}
+
+void receive_chunk(struct Options *options, struct RatingBuffers *buffers, int b, int count) {
+    MPI_Irecv(buffers->wire[b], get_encoded_count(options->encoding, count), get_encoding_datatype(options->encoding), 0, TAG_RATINGS, MPI_COMM_WORLD, &buffers->requests[b]);
+}
+
+/*
+Worker side: count one product's ratings into histogram, generating them locally or receiving them from
+rank 0. With --pipeline the receive for chunk k + 1 is already posted while chunk k is counted.
+*/
+void get_product_histogram(struct Options *options, struct RatingBuffers *buffers, int product, long long *histogram) {
+    long long n = get_product_rating_count(options, product);
+    int chunk_size = options->chunk_size;
+    enum Encoding encoding = options->encoding;
+    for (int v = 0; v < RATING_VALUES; v++) {
+        histogram[v] = 0;
+    }
+
+    if (options->generate == GENERATE_WORKER) {
+        for (long long first = 0; first < n; first += chunk_size) {
+            int count = get_chunk_count(n, first, chunk_size);
+            get_ratings_from_stream_threaded(buffers->ratings, count, options->seed, product, first);
+            histogram_encoded_ratings_threaded(ENCODING_INT, buffers->ratings, count, histogram);
+        }
+    } else if (!options->pipeline) {
+        for (long long first = 0; first < n; first += chunk_size) {
+            int count = get_chunk_count(n, first, chunk_size);
+            PROFILE_BEGIN(PROFILE_RECEIVE);
+            MPI_Recv(buffers->wire[0], get_encoded_count(encoding, count), get_encoding_datatype(encoding), 0, TAG_RATINGS, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            PROFILE_END(PROFILE_RECEIVE);
+            histogram_encoded_ratings_threaded(encoding, buffers->wire[0], count, histogram);
+        }
+    } else {
+        int b = 0;
+        receive_chunk(options, buffers, b, get_chunk_count(n, 0, chunk_size));
+        for (long long first = 0; first < n; first += chunk_size) {
+            long long next_first = first + chunk_size;
+            if (next_first < n) {
+                receive_chunk(options, buffers, 1 - b, get_chunk_count(n, next_first, chunk_size));
+            }
+            PROFILE_BEGIN(PROFILE_RECEIVE);
+            MPI_Wait(&buffers->requests[b], MPI_STATUS_IGNORE);
+            PROFILE_END(PROFILE_RECEIVE);
+            histogram_encoded_ratings_threaded(encoding, buffers->wire[b], get_chunk_count(n, first, chunk_size), histogram);
+            b = 1 - b;
+        }
+    }
+}
+
+/*
+Kernel microbenchmark (--bench-kernels).
+
+Times every available histogram kernel on n ratings in each encoding and reports the bandwidth it reads the
+encoded ratings at, next to the original summation loop since that was all a product used to cost. Its 32-bit
+accumulator is unsigned so it wraps instead of overflowing past ~430 million ratings; only its speed is
+meaningful there, and it keeps the same instructions as the original int sum. Each
+kernel is repeated until at least BENCH_MIN_SECONDS have passed.
+*/
+long long sum_int_ratings_baseline(const int *ratings, long long n) {
+    unsigned sum = 0;
+    for (long long i = 0; i < n; i++) {
+        sum += (unsigned)ratings[i];
+    }
+    return sum;
+}
+
+long long get_histogram_sum(const long long *histogram) {
+    long long sum = 0;
+    for (int v = 0; v < RATING_VALUES; v++) {
+        sum += (v + 1) * histogram[v];
+    }
+    return sum;
+}
+
+// Adapters so every kernel can be timed through one signature, the histogram kernels return the sum they imply
+long long bench_sum_baseline(const void *data, long long n) { return sum_int_ratings_baseline((const int *)data, n); }
+
+long long bench_histogram_int(const void *data, long long n) {
+    long long histogram[RATING_VALUES] = {0};
+    histogram_kernels.histogram_int((const int *)data, n, histogram);
+    return get_histogram_sum(histogram);
+}
+
+long long bench_histogram_u8(const void *data, long long n) {
+    long long histogram[RATING_VALUES] = {0};
+    histogram_kernels.histogram_u8((const uint8_t *)data, n, histogram);
+    return get_histogram_sum(histogram);
+}
+
+long long bench_histogram_packed(const void *data, long long n) {
+    long long histogram[RATING_VALUES] = {0};
+    histogram_kernels.histogram_packed((const uint64_t *)data, n, histogram);
+    return get_histogram_sum(histogram);
+}
+
+// Prints one result row and returns the seconds per call
+double bench_kernel(const char *encoding_name, const char *kernel_name, long long (*sum)(const void *, long long), const void *data, long long count, size_t bytes, long long n, double baseline_seconds) {
+    volatile long long sink = 0;
+    int repetitions = 0;
+    double start = MPI_Wtime();
+    double elapsed;
+    do {
+        sink += sum(data, count);
+        repetitions++;
+        elapsed = MPI_Wtime() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+    (void)sink;
+
+    double seconds = elapsed / repetitions;
+    printf("%-8s %-10s %12.6f %10.2f %12.1f %10.2fx\n", encoding_name, kernel_name, seconds, bytes / seconds / 1e9, n / seconds / 1e6, baseline_seconds > 0 ? baseline_seconds / seconds : 1.0);
+    return seconds;
+}
+
+void run_kernel_benchmark(struct Options *options) {
+    long long n = options->n;
+    long long word_count = (n + RATINGS_PER_PACKED_WORD - 1) / RATINGS_PER_PACKED_WORD;
+    int *ratings = (int *)malloc(n * sizeof(int));
+    uint8_t *bytes = (uint8_t *)malloc(n * sizeof(uint8_t));
+    uint64_t *words = (uint64_t *)malloc(word_count * sizeof(uint64_t));
+    if (ratings == NULL || bytes == NULL || words == NULL) {
+        printf("Could not allocate %lld ratings for the benchmark\n", n);
+        free(ratings);
+        free(bytes);
+        free(words);
+        return;
+    }
+
+    // Packed chunks must start on a word boundary, so every chunk is a whole number of words
+    int chunk_size = get_chunk_size(n);
+    chunk_size -= chunk_size % RATINGS_PER_PACKED_WORD;
+    if (chunk_size == 0) {
+        chunk_size = (int)n;
+    }
+    for (long long first = 0; first < n; first += chunk_size) {
+        int count = n - first < chunk_size ? (int)(n - first) : chunk_size;
+        get_ratings_from_stream(ratings + first, count, 1, 1, first);
+        encode_ratings(ENCODING_U8, ratings + first, count, bytes + first);
+        encode_ratings(ENCODING_PACKED, ratings + first, count, words + first / RATINGS_PER_PACKED_WORD);
+    }
+
+    printf("Histogram kernel benchmark, n = %'lld ratings\n\n", n);
+    printf("%-8s %-10s %12s %10s %12s %11s\n", "encoding", "kernel", "seconds", "GB/s", "Mratings/s", "vs baseline");
+
+    double baseline_seconds = bench_kernel("int", "baseline", bench_sum_baseline, ratings, n, n * sizeof(int), n, 0);
+
+    enum Kernel kernels[] = {KERNEL_SCALAR, KERNEL_AVX2, KERNEL_AVX512};
+    struct HistogramKernels selected = histogram_kernels;
+    for (int k = 0; k < 3; k++) {
+        if (select_histogram_kernels(kernels[k])) {
+            continue;
+        }
+        long long from_int[RATING_VALUES] = {0}, from_u8[RATING_VALUES] = {0}, from_packed[RATING_VALUES] = {0};
+        histogram_kernels.histogram_int(ratings, n, from_int);
+        histogram_kernels.histogram_u8(bytes, n, from_u8);
+        histogram_kernels.histogram_packed(words, word_count, from_packed);
+        if (memcmp(from_int, from_u8, sizeof(from_int)) != 0 || memcmp(from_int, from_packed, sizeof(from_int)) != 0) {
+            printf("%s kernels disagree with each other, int sum = %lld\n", histogram_kernels.name, get_histogram_sum(from_int));
+        }
+        bench_kernel("int", histogram_kernels.name, bench_histogram_int, ratings, n, n * sizeof(int), n, baseline_seconds);
+        bench_kernel("u8", histogram_kernels.name, bench_histogram_u8, bytes, n, n * sizeof(uint8_t), n, baseline_seconds);
+        bench_kernel("packed", histogram_kernels.name, bench_histogram_packed, words, word_count, word_count * sizeof(uint64_t), n, baseline_seconds);
+    }
+    histogram_kernels = selected;
+
+    free(ratings);
+    free(bytes);
+    free(words);
+}
+
+/*
+Service snapshots (--snapshot, --restore).
+
+A snapshot is a SnapshotHeader followed by m records of RATING_VALUES 64-bit counts, product 1's first. It
+holds only per-product aggregates, so its size and the time to restore it depend on m and not on how many
+ratings have been seen. The version is bumped whenever the layout changes and older files are refused.
+*/
+struct SnapshotHeader {
+    char magic[8];          // SNAPSHOT_MAGIC, not NUL-terminated
+    uint32_t version;       // SNAPSHOT_VERSION
+    uint32_t record_values; // counts per record, RATING_VALUES
+    uint64_t m;
+    uint64_t n;             // initial ratings per product
+    uint64_t seed;          // of the rating streams
+    uint64_t watermark;     // batches folded into the records
+    uint64_t delta;         // ratings per batch
+    uint64_t workers;       // the batches were split across this many workers
+};
+
+// Maps the whole file read-only, NULL when it cannot be opened or is empty
+const char *map_snapshot(const char *path, size_t *bytes) {
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor < 0) {
+        return NULL;
+    }
+    struct stat status;
+    void *mapping = MAP_FAILED;
+    if (fstat(descriptor, &status) == 0 && status.st_size > 0) {
+        mapping = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    }
+    close(descriptor);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    *bytes = (size_t)status.st_size;
+    return (const char *)mapping;
+}
+
+// What is wrong with a mapped snapshot for this run, NULL when it can be restored
+const char *get_snapshot_problem(const char *mapping, size_t bytes, struct Options *options, int size) {
+    int m = options->m;
+    const struct SnapshotHeader *header = (const struct SnapshotHeader *)mapping;
+    if (bytes < sizeof(struct SnapshotHeader) || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) {
+        return "is not a ratings snapshot";
+    } else if (header->version != SNAPSHOT_VERSION || header->record_values != RATING_VALUES) {
+        return "has an unsupported version";
+    } else if (header->m != (uint64_t)m) {
+        return "was written for a different m";
+    } else if (header->n != (uint64_t)options->n) {
+        return "was written for a different n";
+    } else if (header->delta != (uint64_t)options->delta) {
+        return "was written for a different --delta";
+    } else if (header->workers != (uint64_t)(size - 1)) {
+        return "was written by a different number of workers, which split the batches differently";
+    } else if (bytes != sizeof(struct SnapshotHeader) + (size_t)m * RATING_VALUES * sizeof(long long)) {
+        return "is truncated";
+    }
+    return NULL;
+}
+
+// Rank 0 checks the snapshot and every rank takes its seed and watermark
+int load_snapshot_header(struct Options *options, int rank, int size) {
+    unsigned long long values[3] = {0, 0, 0}; // usable, seed, watermark
+    if (rank == 0) {
+        size_t bytes = 0;
+        const char *mapping = map_snapshot(options->restore_path, &bytes);
+        const char *problem = mapping == NULL ? "cannot be read" : get_snapshot_problem(mapping, bytes, options, size);
+        if (problem != NULL) {
+            printf("Snapshot %s %s\n", options->restore_path, problem);
+        } else {
+            const struct SnapshotHeader *header = (const struct SnapshotHeader *)mapping;
+            values[0] = 1;
+            values[1] = header->seed;
+            values[2] = header->watermark;
+        }
+        if (mapping != NULL) {
+            munmap((void *)mapping, bytes);
+        }
+    }
+    MPI_Bcast(values, 3, MPI_UNSIGNED_LONG_LONG, 0, MPI_COMM_WORLD);
+    if (!values[0]) {
+        return 1;
+    }
+    if (values[2] >= (unsigned long long)options->service_batches) {
+        if (rank == 0) {
+            printf("Snapshot %s already holds %llu batches, --service=%d has none left to run\n", options->restore_path, values[2], options->service_batches);
+        }
+        return 1;
+    }
+    options->seed = values[1];
+    options->has_seed = 1;
+    options->watermark = (int)values[2];
+    return 0;
+}
+
+int parse_option(const char *arg, struct Options *options) {
+    if (strcmp(arg, "--schedule=static") == 0) {
+        options->schedule = SCHEDULE_STATIC;
+    } else if (strcmp(arg, "--schedule=dynamic") == 0) {
+        options->schedule = SCHEDULE_DYNAMIC;
+    } else if (strcmp(arg, "--generate=master") == 0) {
+        options->generate = GENERATE_MASTER;
+    } else if (strcmp(arg, "--generate=worker") == 0) {
+        options->generate = GENERATE_WORKER;
+    } else if (strncmp(arg, "--seed=", 7) == 0) {
+        char *end;
+        options->seed = strtoull(arg + 7, &end, 10);
+        if (end == arg + 7 || *end != '\0') {
+            return 1;
+        }
+        options->has_seed = 1;
+    } else if (strncmp(arg, "--skew=", 7) == 0) {
+        char *end;
+        options->skew = strtod(arg + 7, &end);
+        if (end == arg + 7 || *end != '\0' || options->skew < 0) {
+            return 1;
+        }
+        options->has_skew = 1;
+    } else if (strcmp(arg, "--encoding=int") == 0) {
+        options->encoding = ENCODING_INT;
+    } else if (strcmp(arg, "--encoding=u8") == 0) {
+        options->encoding = ENCODING_U8;
+    } else if (strcmp(arg, "--encoding=packed") == 0) {
+        options->encoding = ENCODING_PACKED;
+    } else if (strncmp(arg, "--threads=", 10) == 0) {
+        options->threads = atoi(arg + 10);
+        if (options->threads < 1) {
+            return 1;
+        }
+    } else if (strcmp(arg, "--pipeline") == 0) {
+        options->pipeline = 1;
+    } else if (strncmp(arg, "--chunk=", 8) == 0) {
+        options->chunk_size = atoi(arg + 8);
+        if (options->chunk_size < 1) {
+            return 1;
+        }
+    } else if (strcmp(arg, "--path=p2p") == 0) {
+        options->path = PATH_P2P;
+    } else if (strcmp(arg, "--path=collective") == 0) {
+        options->path = PATH_COLLECTIVE;
+    } else if (strcmp(arg, "--path=shared") == 0) {
+        options->path = PATH_SHARED;
+    } else if (strcmp(arg, "--path=rma") == 0) {
+        options->path = PATH_RMA;
+    } else if (strncmp(arg, "--top=", 6) == 0) {
+        options->top_k = atoi(arg + 6);
+        if (options->top_k < 1) {
+            return 1;
+        }
+    } else if (strncmp(arg, "--service=", 10) == 0) {
+        options->service_batches = atoi(arg + 10);
+        if (options->service_batches < 1) {
+            return 1;
+        }
+    } else if (strncmp(arg, "--delta=", 8) == 0) {
+        options->delta = atoi(arg + 8);
+        if (options->delta < 1) {
+            return 1;
+        }
+    } else if (strncmp(arg, "--snapshot=", 11) == 0) {
+        options->snapshot_path = arg + 11;
+        if (options->snapshot_path[0] == '\0') {
+            return 1;
+        }
+    } else if (strncmp(arg, "--snapshot-every=", 17) == 0) {
+        options->snapshot_every = atoi(arg + 17);
+        if (options->snapshot_every < 1) {
+            return 1;
+        }
+    } else if (strncmp(arg, "--restore=", 10) == 0) {
+        options->restore_path = arg + 10;
+        if (options->restore_path[0] == '\0') {
+            return 1;
+        }
+    } else if (strncmp(arg, "--trace=", 8) == 0) {
+        options->trace_prefix = arg + 8;
+        if (options->trace_prefix[0] == '\0') {
+            return 1;
+        }
+    } else if (strcmp(arg, "--rank-by=mean") == 0) {
+        options->rank_by = RANK_BY_MEAN;
+    } else if (strcmp(arg, "--rank-by=bayesian") == 0) {
+        options->rank_by = RANK_BY_BAYESIAN;
+    } else if (strcmp(arg, "--rank-by=median") == 0) {
+        options->rank_by = RANK_BY_MEDIAN;
+    } else if (strcmp(arg, "--rank-by=p25") == 0) {
+        options->rank_by = RANK_BY_PERCENTILE_25;
+    } else if (strcmp(arg, "--rank-by=p75") == 0) {
+        options->rank_by = RANK_BY_PERCENTILE_75;
+    } else if (strncmp(arg, "--prior=", 8) == 0) {
+        char *end;
+        options->prior_mean = strtod(arg + 8, &end);
+        if (end == arg + 8 || *end != ',') {
+            return 1;
+        }
+        const char *weight = end + 1;
+        options->prior_weight = strtod(weight, &end);
+        if (end == weight || *end != '\0' || options->prior_weight < 0) {
+            return 1;
+        }
+    } else if (strcmp(arg, "--stats") == 0) {
+        options->stats = 1;
+    } else if (strcmp(arg, "--timing") == 0) {
+        options->timing = 1;
+    } else if (strcmp(arg, "--kernel=auto") == 0) {
+        options->kernel = KERNEL_AUTO;
+    } else if (strcmp(arg, "--kernel=scalar") == 0) {
+        options->kernel = KERNEL_SCALAR;
+    } else if (strcmp(arg, "--kernel=avx2") == 0) {
+        options->kernel = KERNEL_AVX2;
+    } else if (strcmp(arg, "--kernel=avx512") == 0) {
+        options->kernel = KERNEL_AVX512;
+    } else if (strcmp(arg, "--bench-kernels") == 0) {
+        options->bench_kernels = 1;
+    } else if (strncmp(arg, "--input=", 8) == 0) {
+        options->input_path = arg + 8;
+        if (options->input_path[0] == '\0') {
+            return 1;
+        }
+    } else if (strcmp(arg, "--input-format=binary") == 0) {
+        options->input_format = INPUT_BINARY;
+        options->has_input_format = 1;
+    } else if (strcmp(arg, "--input-format=csv") == 0) {
+        options->input_format = INPUT_CSV;
+        options->has_input_format = 1;
+    } else if (strncmp(arg, "--batch=", 8) == 0) {
+        options->batch_size = atoi(arg + 8);
+        if (options->batch_size < 1) {
+            return 1;
+        }
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+int is_argument_error(int argc, char **argv, int rank, int size, struct Options *options) {
+    if (argc < 3) {
+        if (rank == 0) {
+            printf("Ensure to enter an m and n as command line arguments, m is the number of products to be rated and n is the number of ratings for each product.\n");
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
+    options->m = atoi(argv[1]);
+    options->n = atoll(argv[2]);
+    options->schedule = SCHEDULE_STATIC;
+    options->batch_size = 0;
+    options->encoding = ENCODING_INT;
+    options->kernel = KERNEL_AUTO;
+    options->bench_kernels = 0;
+    options->threads = 0;
+    options->pipeline = 0;
+    options->chunk_size = 0;
+    options->path = PATH_P2P;
+    options->top_k = 0;
+    options->rank_by = RANK_BY_MEAN;
+    options->prior_mean = PRIOR_MEAN;
+    options->prior_weight = PRIOR_WEIGHT;
+    options->stats = 0;
+    options->timing = 0;
+    options->service_batches = 0;
+    options->delta = SERVICE_DELTA_RATINGS;
+    options->snapshot_path = NULL;
+    options->snapshot_every = SNAPSHOT_EVERY_BATCHES;
+    options->restore_path = NULL;
+    options->watermark = 0;
+    options->trace_prefix = NULL;
+    options->generate = GENERATE_MASTER;
+    options->has_seed = 0;
+    options->seed = 0;
+    options->input_path = NULL;
+    options->input_format = INPUT_BINARY;
+    options->has_input_format = 0;
+    options->has_skew = 0;
+    options->skew = 0.0;
+    options->product_ratings = NULL;
+
+    for (int i = 3; i < argc; i++) {
+        if (parse_option(argv[i], options)) {
+            if (rank == 0) {
+                printf("Unknown or invalid option: %s\n", argv[i]);
+            }
+            MPI_Finalize();
+            return 1;
+        }
+    }
+
+    if (options->input_path != NULL && !options->has_input_format) {
+        size_t length = strlen(options->input_path);
+        if (length >= 4 && strcmp(options->input_path + length - 4, ".csv") == 0) {
+            options->input_format = INPUT_CSV;
+        }
+    }
+
+    int m = options->m;
+    long long n = options->n;
+    int reads_file = options->input_path != NULL;
+    int service = options->service_batches > 0;
+    // File input and the collective and shared paths have no dedicated master, any rank count works
+    int needs_workers = !reads_file && (options->path == PATH_P2P || options->path == PATH_RMA || service);
+    int checks_n = !reads_file || options->input_format == INPUT_BINARY;
+
+#ifdef _OPENMP
+    if (options->threads > 0) {
+        omp_set_num_threads(options->threads);
+    }
+#endif
+
+    if (select_histogram_kernels(options->kernel)) {
+        if (rank == 0) {
+            printf("The requested histogram kernel is not supported on this CPU\n");
+        }
+        MPI_Finalize();
+        return 1;
+    } else if (options->bench_kernels) {
+        if (n < 1) {
+            if (rank == 0) {
+                printf("n must be greater than 0\n");
+            }
+            MPI_Finalize();
+            return 1;
+        }
+        return 0;
+#ifndef RATINGS_PROFILE
+    } else if (options->trace_prefix != NULL) {
+        if (rank == 0) {
+            printf("--trace needs a build with -DRATINGS_PROFILE\n");
+        }
+        MPI_Finalize();
+        return 1;
+#endif
+    } else if (options->path == PATH_SHARED && options->generate == GENERATE_WORKER && !reads_file && !service) {
+        if (rank == 0) {
+            printf("--path=shared shares rank 0's ratings and cannot be combined with --generate=worker\n");
+        }
+        MPI_Finalize();
+        return 1;
+    } else if (options->path == PATH_RMA && options->generate == GENERATE_WORKER && !reads_file && !service) {
+        if (rank == 0) {
+            printf("--path=rma fetches rank 0's ratings and cannot be combined with --generate=worker\n");
+        }
+        MPI_Finalize();
+        return 1;
+    } else if ((options->snapshot_path != NULL || options->restore_path != NULL) && !service) {
+        if (rank == 0) {
+            printf("--snapshot and --restore keep the state of --service and need it\n");
+        }
+        MPI_Finalize();
+        return 1;
+    } else if (options->restore_path != NULL && options->has_seed) {
+        if (rank == 0) {
+            printf("--restore continues with the snapshot's seed and cannot be combined with --seed\n");
+        }
+        MPI_Finalize();
+        return 1;
+    } else if (service && reads_file) {
+        if (rank == 0) {
+            printf("--service generates its ratings and cannot be combined with --input\n");
+        }
+        MPI_Finalize();
+        return 1;
+    } else if (size < 2 && needs_workers) {
+        if (rank == 0) {
+            printf("At least 2 processes are needed, one master and one or more workers\n");
+        }
+        MPI_Finalize();
+        return 1;
+    } else if (options->schedule == SCHEDULE_STATIC && options->path == PATH_P2P && m > size - 1 && needs_workers && !service) {
+        if (rank == 0) {
+            printf("m cannot be greater than the number of cores minus 1. Number of cores: %d (use --schedule=dynamic for larger m)\n", size);
+        }
+        MPI_Finalize();
+        return 1;
+    } else if(checks_n && n < 5) {
+        if (rank == 0) {
+            printf("n must be greater than 5\n");
+        }
+        MPI_Finalize();
+        return 1;
+    } else if (checks_n && n > MAX_RATINGS_PER_PRODUCT) {
+        if (rank == 0) {
+            printf("n must be at most %'lld\n", MAX_RATINGS_PER_PRODUCT);
+        }
+        MPI_Finalize();
+        return 1;
+    } else if (m < 1) {
+        if (rank == 0) {
+            printf("m must be greater than 0\n");
+        }
+        MPI_Finalize();
+        return 1;
+    } else if (reads_file && m > INT_MAX / RATING_VALUES) {
+        if (rank == 0) {
+            printf("m must be at most %'d with --input, its histograms are reduced in one call\n", INT_MAX / RATING_VALUES);
+        }
+        MPI_Finalize();
+        return 1;
+    } else if (checks_n && n < 1) {
+        if (rank == 0) {
+            printf("n must be greater than 0\n");
+        }
+        MPI_Finalize();
+        return 1;
+    } else if (options->has_skew && (reads_file || service || options->path == PATH_SHARED || options->path == PATH_RMA)) {
+        if (rank == 0) {
+            printf("--skew generates its own rating counts and needs --path=p2p or --path=collective without --input or --service\n");
+        }
+        MPI_Finalize();
+        return 1;
+    } else if (options->has_skew && (n > MAX_RATINGS_PER_PRODUCT / m || m > INT_MAX / RATING_VALUES - size)) {
+        if (rank == 0) {
+            printf("With --skew, m * n must be at most %'lld and m at most %'d\n", MAX_RATINGS_PER_PRODUCT, INT_MAX / RATING_VALUES - size);
+        }
+        MPI_Finalize();
+        return 1;
+    } else {
+        // Product 1 has the most ratings, chunks never need to be longer than it
+        long long largest = n;
+        if (options->has_skew) {
+            options->product_ratings = get_zipf_rating_counts(m, n, options->skew);
+            largest = options->product_ratings[0];
+        }
+        if (options->chunk_size == 0) {
+            options->chunk_size = options->pipeline ? PIPELINE_CHUNK_RATINGS : MAX_RATINGS_PER_MESSAGE;
+        }
+        if (options->chunk_size > MAX_RATINGS_PER_MESSAGE) {
+            options->chunk_size = MAX_RATINGS_PER_MESSAGE;
+        }
+        // The partitioned and collective paths scatter one chunk per rank from a single buffer, at int displacements
+        if (options->chunk_size > INT_MAX / size) {
+            options->chunk_size = INT_MAX / size;
+        }
+        if (largest >= 1 && options->chunk_size > largest) {
+            options->chunk_size = (int)largest;
+        }
+
+        if (options->batch_size == 0 && size > 1) {
+            int workers = size - 1;
+            options->batch_size = m / (workers * BATCHES_PER_WORKER);
+            if (options->batch_size < 1) {
+                options->batch_size = 1;
+            }
+        }
+
+        if (service && options->top_k == 0) {
+            options->top_k = SERVICE_TOP_K;
+        }
+
+        // A restored service continues the snapshot's rating streams, so it takes the snapshot's seed
+        if (options->restore_path != NULL && load_snapshot_header(options, rank, size)) {
+            MPI_Finalize();
+            return 1;
+        }
+
+        options->use_counter_rng = options->has_seed || options->generate == GENERATE_WORKER || service;
+        if (options->use_counter_rng && !options->has_seed) {
+            // Every rank must agree on the seed, so rank 0 picks it and shares it
+            unsigned long long seed = (unsigned long long)time(NULL);
+            MPI_Bcast(&seed, 1, MPI_UNSIGNED_LONG_LONG, 0, MPI_COMM_WORLD);
+            options->seed = seed;
+            options->has_seed = 1;
+        }
+        return 0;
+    }
+}
+
+// The --rank-by key is always printed, --stats prints every statistic
+void print_sorted_ratings(struct Options *options, struct RatingToRank *ratings_to_rank_averages, int count) {
+    int stats = options->stats;
+    enum RankBy rank_by = options->rank_by;
+    printf("\nSorted Product Ratings:\n\n");
+    for (int i = 0; i < count; i++) {
+        struct RatingToRank *result = &ratings_to_rank_averages[i];
+        printf("╔══════════════════════════════════════╗\n");
+        printf("║           Product Rating %d           ║\n", i + 1);
+        printf("╠══════════════════════════════════════╣\n");
+        printf("║ Worker:         %-20d ║\n", result->rank);
+        printf("║ Product:        %-20d ║\n", result->product);
+        printf("║ Average Rating: %-20.4f ║\n", result->average_rating);
+        if (stats || rank_by == RANK_BY_BAYESIAN) {
+            printf("║ Bayesian Avg:   %-20.4f ║\n", result->bayesian_average);
+        }
+        if (stats) {
+            printf("║ Variance:       %-20.4f ║\n", result->variance);
+        }
+        if (stats || rank_by == RANK_BY_MEDIAN) {
+            printf("║ Median:         %-20.1f ║\n", result->median);
+        }
+        if (stats || rank_by == RANK_BY_PERCENTILE_25) {
+            printf("║ Percentile 25:  %-20.0f ║\n", result->percentile_25);
+        }
+        if (stats || rank_by == RANK_BY_PERCENTILE_75) {
+            printf("║ Percentile 75:  %-20.0f ║\n", result->percentile_75);
+        }
+        printf("║ Ratings:        %-'20lld ║\n", result->rating_count);
+        printf("╚══════════════════════════════════════╝\n\n");
+    }
+}
+
+// Static schedule: product i goes to worker rank i, one message each way
+void run_static_master(struct Options *options, struct RatingToRank *ratings_to_rank_averages) {
+    int m = options->m;
+    struct RatingBuffers buffers;
+    allocate_rating_buffers(options, &buffers);
+
+    // When pipelining, results are accepted as soon as each worker finishes instead of after the last send
+    MPI_Request *result_requests = NULL;
+    if (options->pipeline) {
+        result_requests = (MPI_Request *)malloc(m * sizeof(MPI_Request));
+        for (int i = 0; i < m; i++) {
+            MPI_Irecv(&ratings_to_rank_averages[i], 1, rating_to_rank_type, i + 1, TAG_RESULT, MPI_COMM_WORLD, &result_requests[i]);
+        }
+    }
+
+    for (int i = 0; i < m; i++) {
+        if (options->generate == GENERATE_WORKER) {
+            break; // Workers generate their own product, only the results come back
+        }
+
+        /* Following print is used to help in verifying the output of the program */
+        // printf("Worker %d's first 10 ratings for product %d are: ", rank, i+1);
+        // for (int j = 0; j < 10; j++) {  // Print first 10 ratings
+        //     printf("%d ", ratings[j]);
+        // }
+        // printf("\n");
+
+        send_product_ratings(options, &buffers, i + 1, i + 1);
+    }
+
+    PROFILE_BEGIN(PROFILE_RECEIVE);
+    if (options->pipeline) {
+        MPI_Waitall(m, result_requests, MPI_STATUSES_IGNORE);
+        free(result_requests);
+    } else {
+        for (int i = 0; i < m; i++) {
+            MPI_Recv(&ratings_to_rank_averages[i], 1, rating_to_rank_type, i + 1, TAG_RESULT, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        }
+    }
+    PROFILE_END(PROFILE_RECEIVE);
+
+    free_rating_buffers(&buffers);
+}
+
+void run_static_worker(struct Options *options, int rank) {
+    struct RatingBuffers buffers;
+    allocate_rating_buffers(options, &buffers);
+
+    long long histogram[RATING_VALUES];
+    get_product_histogram(options, &buffers, rank, histogram);
+
+    struct RatingToRank result;
+    score_histogram(options, histogram, rank, rank, &result);
+    PROFILE_BEGIN(PROFILE_SEND);
+    MPI_Send(&result, 1, rating_to_rank_type, 0, TAG_RESULT, MPI_COMM_WORLD);
+    PROFILE_END(PROFILE_SEND);
+    PROFILE_SEND(sizeof(result));
+
+    free_rating_buffers(&buffers);
+}
+
+/*
+Dynamic schedule: a master/worker work queue.
+
+Every worker starts by sending an (empty) result message, which doubles as its request for work.
+The master answers each request with the next batch {first product, count} followed by the ratings
+for those products, and the worker answers with the batch's results, which is again a request for
+more work. Once the queue is empty the master answers with a count of 0 and the worker stops.
+
+Workers are served in the order they ask, so a fast worker keeps pulling batches while a slow one is
+still busy and m is no longer tied to the number of ranks.
+*/
+// Returns the number of results left in ratings_to_rank_averages, m or at most --top
+int run_dynamic_master(struct Options *options, int size, struct RatingToRank *ratings_to_rank_averages) {
+    int m = options->m;
+    int batch_size = options->batch_size;
+    struct RatingBuffers buffers;
+    allocate_rating_buffers(options, &buffers);
+    struct RatingToRank *batch_results = (struct RatingToRank *)malloc(batch_size * sizeof(struct RatingToRank));
+
+    int next_product = 1;
+    int active_workers = size - 1;
+
+    while (active_workers > 0) {
+        MPI_Status status;
+        int result_count;
+
+        // Any worker may ask next, the size of its message tells us how many results it carries
+        PROFILE_BEGIN(PROFILE_RECEIVE);
+        MPI_Probe(MPI_ANY_SOURCE, TAG_RESULT, MPI_COMM_WORLD, &status);
+        MPI_Get_count(&status, rating_to_rank_type, &result_count);
+        int worker = status.MPI_SOURCE;
+
+        MPI_Recv(batch_results, result_count, rating_to_rank_type, worker, TAG_RESULT, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        PROFILE_END(PROFILE_RECEIVE);
+        for (int i = 0; i < result_count; i++) {
+            ratings_to_rank_averages[batch_results[i].product - 1] = batch_results[i];
+        }
+
+        int assignment[2] = {next_product, 0};
+        if (next_product <= m) {
+            assignment[1] = m - next_product + 1 < batch_size ? m - next_product + 1 : batch_size;
+        }
+        PROFILE_BEGIN(PROFILE_SEND);
+        MPI_Send(assignment, 2, MPI_INT, worker, TAG_WORK_ASSIGN, MPI_COMM_WORLD);
+        PROFILE_END(PROFILE_SEND);
+        PROFILE_SEND(sizeof(assignment));
+
+        if (assignment[1] == 0) {
+            active_workers--;
+            continue;
+        }
+
+        for (int i = 0; i < assignment[1] && options->generate == GENERATE_MASTER; i++) {
+            send_product_ratings(options, &buffers, assignment[0] + i, worker);
+        }
+        next_product += assignment[1];
+    }
+
+    free(batch_results);
+    free_rating_buffers(&buffers);
+
+    // With --top the workers kept their results and only their top k lists come back
+    if (options->top_k > 0) {
+        return gather_top_k(NULL, 0, options->top_k, 0, size, ratings_to_rank_averages);
+    }
+    return m;
+}
+
+/*
+With --top a worker does not return each batch's results, it folds them into its own top k (batch results
+are appended after the current top k and the heap selection runs again) and requests more work with empty
+result messages. The top k lists are merged on rank 0 once the queue is empty.
+*/
+void run_dynamic_worker(struct Options *options, int rank, int size) {
+    struct RatingBuffers buffers;
+    allocate_rating_buffers(options, &buffers);
+    int top_k = options->top_k;
+    struct RatingToRank *top_results = NULL;
+    int top_count = 0;
+    if (top_k > 0) {
+        top_results = (struct RatingToRank *)malloc((top_k + options->batch_size) * sizeof(struct RatingToRank));
+    }
+    struct RatingToRank *batch_results = (struct RatingToRank *)malloc(options->batch_size * sizeof(struct RatingToRank));
+    int result_count = 0;
+
+    while (1) {
+        if (top_k > 0) {
+            memcpy(top_results + top_count, batch_results, result_count * sizeof(struct RatingToRank));
+            top_count = keep_top_k(top_results, top_count + result_count, top_k);
+            result_count = 0;
+        }
+        PROFILE_BEGIN(PROFILE_SEND);
+        MPI_Send(batch_results, result_count, rating_to_rank_type, 0, TAG_RESULT, MPI_COMM_WORLD);
+        PROFILE_END(PROFILE_SEND);
+        PROFILE_SEND(result_count * sizeof(struct RatingToRank));
+
+        int assignment[2];
+        PROFILE_BEGIN(PROFILE_RECEIVE);
+        MPI_Recv(assignment, 2, MPI_INT, 0, TAG_WORK_ASSIGN, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        PROFILE_END(PROFILE_RECEIVE);
+        if (assignment[1] == 0) {
+            break;
+        }
+
+        for (int i = 0; i < assignment[1]; i++) {
+            long long histogram[RATING_VALUES];
+            get_product_histogram(options, &buffers, assignment[0] + i, histogram);
+            score_histogram(options, histogram, rank, assignment[0] + i, &batch_results[i]);
+        }
+        result_count = assignment[1];
+    }
+
+    if (top_k > 0) {
+        gather_top_k(top_results, top_count, top_k, rank, size, NULL);
+        free(top_results);
+    }
+    free(batch_results);
+    free_rating_buffers(&buffers);
+}
+
+/*
+Result collection shared by the collective and shared-memory paths: every rank holds the results of the
+products it scored. The best product is found with MPI_Reduce and a custom MPI_Op, then rank 0 receives either
+every result with one MPI_Gatherv or, with --top, the merged top k. Returns the number of results rank 0 holds.
+*/
+int collect_local_results(struct Options *options, struct RatingToRank *local_results, int local_count, int rank, int size, struct RatingToRank *ratings_to_rank_averages) {
+    // The best product is also found with a reduction, ranks without products offer a rating no product can lose to
+    MPI_Op best_op;
+    MPI_Op_create(best_rating_op, 1, &best_op);
+    struct RatingToRank local_best = {0};
+    local_best.average_rating = local_best.score = -1.0;
+    local_best.rank = rank;
+    local_best.product = options->m + 1;
+    for (int i = 0; i < local_count; i++) {
+        if (is_better_rating(&local_results[i], &local_best)) {
+            local_best = local_results[i];
+        }
+    }
+    struct RatingToRank best;
+    PROFILE_BEGIN(PROFILE_COLLECTIVE);
+    MPI_Reduce(&local_best, &best, 1, rating_to_rank_type, best_op, 0, MPI_COMM_WORLD);
+    PROFILE_END(PROFILE_COLLECTIVE);
+    PROFILE_SEND(sizeof(local_best));
+    MPI_Op_free(&best_op);
+    if (rank == 0) {
+        printf("Highest rated product: %d (%.4f, scored by rank %d)\n", best.product, best.score, best.rank);
+    }
+
+    int result_count = options->m;
+    if (options->top_k > 0) {
+        result_count = gather_top_k(local_results, local_count, options->top_k, rank, size, ratings_to_rank_averages);
+    } else {
+        // Rank 0 learns how many results each rank holds, then gathers them all in one call
+        int *result_counts = NULL;
+        int *result_displacements = NULL;
+        if (rank == 0) {
+            result_counts = (int *)malloc(size * sizeof(int));
+            result_displacements = (int *)malloc(size * sizeof(int));
+        }
+        PROFILE_BEGIN(PROFILE_COLLECTIVE);
+        MPI_Gather(&local_count, 1, MPI_INT, result_counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        PROFILE_END(PROFILE_COLLECTIVE);
+        if (rank == 0) {
+            result_displacements[0] = 0;
+            for (int r = 1; r < size; r++) {
+                result_displacements[r] = result_displacements[r - 1] + result_counts[r - 1];
+            }
+        }
+        PROFILE_BEGIN(PROFILE_COLLECTIVE);
+        MPI_Gatherv(local_results, local_count, rating_to_rank_type, ratings_to_rank_averages, result_counts, result_displacements, rating_to_rank_type, 0, MPI_COMM_WORLD);
+        PROFILE_END(PROFILE_COLLECTIVE);
+        PROFILE_SEND(local_count * sizeof(struct RatingToRank));
+        free(result_counts);
+        free(result_displacements);
+    }
+
+    return result_count;
+}
+
+/*
+Collective path: products are handed out in rounds with MPI_Scatterv and results are collected with one
+MPI_Gatherv.
+
+Each round gives every rank (rank 0 included) up to per_rank consecutive products. When a product fits in a
+chunk, as many products as fit in SEGMENT_RATINGS (or in a chunk, if --chunk is larger) are packed into each
+rank's segment so small products are not scattered one at a time. Larger products go one per rank per round and are scattered a chunk at a time. Each product's chunk is
+encoded on its own, so a rank's segment is per_rank encoded chunks back to back.
+*/
+// Products each rank takes per round: as many as fit in a segment, but no more than an even share of m. The
+// round buffer holds size segments at int displacements, so size * per_rank * n stays within INT_MAX; a single
+// product always fits since chunk_size is at most INT_MAX / size
+int get_products_per_rank(struct Options *options, int size) {
+    long long n = options->n;
+    int budget = options->chunk_size > SEGMENT_RATINGS ? options->chunk_size : SEGMENT_RATINGS;
+    int per_rank = n <= options->chunk_size ? (int)(budget / n) : 1;
+    if (n <= options->chunk_size && per_rank > INT_MAX / size / n) {
+        per_rank = (int)(INT_MAX / size / n);
+    }
+    int fair_share = (options->m + size - 1) / size;
+    return per_rank < fair_share ? per_rank : fair_share;
+}
+
+// Returns the number of results rank 0 received, m or at most --top
+int run_collective(struct Options *options, int rank, int size, struct RatingToRank *ratings_to_rank_averages) {
+    int m = options->m;
+    long long n = options->n;
+    int chunk_size = options->chunk_size;
+    enum Encoding encoding = options->encoding;
+    MPI_Datatype wire_type = get_encoding_datatype(encoding);
+    size_t element_bytes = get_encoding_element_bytes(encoding);
+
+    int per_rank = get_products_per_rank(options, size);
+    int round_products = per_rank * size;
+    int rounds = (m + round_products - 1) / round_products;
+    int step_ratings = n < chunk_size ? (int)n : chunk_size;
+    int step_units = get_encoded_count(encoding, step_ratings);
+
+    int *ratings = (int *)malloc(step_ratings * sizeof(int));
+    char *segment = (char *)malloc((size_t)per_rank * step_units * element_bytes);
+    char *round_buffer = NULL;
+    int *send_counts = NULL;
+    int *displacements = NULL;
+    if (rank == 0 && options->generate == GENERATE_MASTER) {
+        round_buffer = (char *)malloc((size_t)round_products * step_units * element_bytes);
+        send_counts = (int *)malloc(size * sizeof(int));
+        displacements = (int *)malloc(size * sizeof(int));
+    }
+
+    long long *histograms = (long long *)malloc((size_t)per_rank * RATING_VALUES * sizeof(long long));
+    struct RatingToRank *local_results = (struct RatingToRank *)malloc((size_t)rounds * per_rank * sizeof(struct RatingToRank));
+    int local_count = 0;
+
+    for (int round_first = 1; round_first <= m; round_first += round_products) {
+        int my_first = round_first + rank * per_rank;
+        int my_products = m - my_first + 1 < per_rank ? m - my_first + 1 : per_rank;
+        if (my_products < 0) {
+            my_products = 0;
+        }
+        for (int j = 0; j < per_rank * RATING_VALUES; j++) {
+            histograms[j] = 0;
+        }
+
+        for (long long first = 0; first < n; first += chunk_size) {
+            int count = get_chunk_count(n, first, chunk_size);
+            int units = get_encoded_count(encoding, count);
+
+            if (options->generate == GENERATE_WORKER) {
+                for (int j = 0; j < my_products; j++) {
+                    get_ratings_from_stream_threaded(ratings, count, options->seed, my_first + j, first);
+                    histogram_encoded_ratings_threaded(ENCODING_INT, ratings, count, histograms + j * RATING_VALUES);
+                }
+                continue;
+            }
+
+            if (rank == 0) {
+                for (int r = 0; r < size; r++) {
+                    int first_product = round_first + r * per_rank;
+                    int products = m - first_product + 1 < per_rank ? m - first_product + 1 : per_rank;
+                    if (products < 0) {
+                        products = 0;
+                    }
+                    for (int j = 0; j < products; j++) {
+                        char *wire = round_buffer + ((size_t)r * per_rank + j) * units * element_bytes;
+                        int *chunk = encoding == ENCODING_INT ? (int *)wire : ratings;
+                        get_product_ratings(options, chunk, first_product + j, first, count);
+                        encode_ratings(encoding, chunk, count, wire);
+                    }
+                    send_counts[r] = products * units;
+                    displacements[r] = (int)((long long)r * per_rank * units);
+                }
+            }
+
+            PROFILE_BEGIN(PROFILE_COLLECTIVE);
+            MPI_Scatterv(round_buffer, send_counts, displacements, wire_type, segment, my_products * units, wire_type, 0, MPI_COMM_WORLD);
+            PROFILE_END(PROFILE_COLLECTIVE);
+            if (rank == 0) {
+                PROFILE_SEND(((long long)send_counts[size - 1] + displacements[size - 1]) * element_bytes);
+            }
+
+            for (int j = 0; j < my_products; j++) {
+                histogram_encoded_ratings_threaded(encoding, segment + (size_t)j * units * element_bytes, count, histograms + j * RATING_VALUES);
+            }
+        }
+
+        for (int j = 0; j < my_products; j++) {
+            score_histogram(options, histograms + j * RATING_VALUES, rank, my_first + j, &local_results[local_count++]);
+        }
+    }
 
-    if (is_argument_error(argc, argv, rank, size, m, n)) {
-        return 1;
+    int result_count = collect_local_results(options, local_results, local_count, rank, size, ratings_to_rank_averages);
+
+    free(local_results);
+    free(histograms);
+    free(round_buffer);
+    free(send_counts);
+    free(displacements);
+    free(segment);
+    free(ratings);
+    return result_count;
+}
+
+/*
+Skew-aware collective path (--path=collective with --skew): the products' ratings are treated as one stream,
+product 1's first, and every rank takes an even range of it from calculate_start_and_count. Counting a rating
+costs the same whatever its product, so equal ranges are equal work however the ratings are spread: a hot product
+is split across the ranks whose ranges cover it and light products are packed into one range.
+
+A range is handled chunk_size ratings per round. A chunk is cut into pieces at the product boundaries, each piece
+is encoded on its own so a packed word never holds two products' ratings, and every rank works out the pieces of
+its own chunk from the rating counts, so only the encoded ratings travel in the round's MPI_Scatterv. A rank keeps
+one histogram per product its range touches, a partial one for a product at either end of the range. Rank 0
+gathers every rank's histograms with MPI_Gatherv and adds the partial ones up before scoring.
+*/
+
+// The piece of the stream that starts at position and ends at end or at the end of its product, whichever is first
+// offsets[p] is where product p + 1 starts, *product is advanced to the product that holds position
+int get_stream_piece(const long long *offsets, long long position, long long end, int *product) {
+    while (offsets[*product] <= position) {
+        (*product)++;
     }
+    return (int)((offsets[*product] < end ? offsets[*product] : end) - position);
+}
 
-    if (rank == 0) { // Master process
-        struct RatingToRank *ratings_to_rank_averages = (struct RatingToRank *)malloc(m * sizeof(struct RatingToRank));
-        srand(time(NULL));
-        int *ratings = (int *)malloc(n * sizeof(int));
+// Encoded wire elements of the pieces of [position, end), each piece rounded up to whole elements
+int get_stream_units(enum Encoding encoding, const long long *offsets, long long position, long long end, int product) {
+    int units = 0;
+    while (position < end) {
+        int count = get_stream_piece(offsets, position, end, &product);
+        units += get_encoded_count(encoding, count);
+        position += count;
+    }
+    return units;
+}
+
+void run_partitioned(struct Options *options, int rank, int size, struct RatingToRank *ratings_to_rank_averages) {
+    int m = options->m;
+    int chunk_size = options->chunk_size;
+    enum Encoding encoding = options->encoding;
+    MPI_Datatype wire_type = get_encoding_datatype(encoding);
+    size_t element_bytes = get_encoding_element_bytes(encoding);
+
+    long long *offsets = (long long *)malloc(((size_t)m + 1) * sizeof(long long));
+    offsets[0] = 0;
+    for (int p = 1; p <= m; p++) {
+        offsets[p] = offsets[p - 1] + get_product_rating_count(options, p);
+    }
+    long long total = offsets[m];
+
+    // Every rank's range, rank 0 needs them all to cut the rounds for the scatter
+    long long *starts = (long long *)malloc(size * sizeof(long long));
+    long long *ends = (long long *)malloc(size * sizeof(long long));
+    for (int r = 0; r < size; r++) {
+        long long count;
+        calculate_start_and_count(r, size, total, &starts[r], &count);
+        ends[r] = starts[r] + count;
+    }
+    // Rank 0's range is never shorter than any other
+    long long rounds = (ends[0] - starts[0] + chunk_size - 1) / chunk_size;
+
+    // Products touched by this rank's range, one histogram each
+    int first_product = 0, touched = 0;
+    if (ends[rank] > starts[rank]) {
+        int last_product = 0;
+        get_stream_piece(offsets, starts[rank], ends[rank], &first_product);
+        get_stream_piece(offsets, ends[rank] - 1, ends[rank], &last_product);
+        touched = last_product - first_product + 1;
+    }
+    long long *histograms = (long long *)calloc((size_t)(touched > 0 ? touched : 1) * RATING_VALUES, sizeof(long long));
+
+    // A piece of k ratings never takes more than k wire elements, so a chunk's pieces fit in chunk_size elements
+    int *ratings = (int *)malloc(chunk_size * sizeof(int));
+    char *segment = (char *)malloc((size_t)chunk_size * element_bytes);
+    char *round_buffer = NULL;
+    int *send_counts = NULL;
+    int *displacements = NULL;
+    int *cursors = NULL; // on rank 0, the product of each rank's next piece to generate
+    if (rank == 0 && options->generate == GENERATE_MASTER) {
+        round_buffer = (char *)malloc((size_t)size * chunk_size * element_bytes);
+        send_counts = (int *)malloc(size * sizeof(int));
+        displacements = (int *)malloc(size * sizeof(int));
+        cursors = (int *)calloc(size, sizeof(int));
+    }
+    int cursor = first_product; // the product of this rank's next piece to count
+
+    for (long long round = 0; round < rounds; round++) {
+        long long my_first = starts[rank] + round * chunk_size;
+        long long my_end = my_first + chunk_size < ends[rank] ? my_first + chunk_size : ends[rank];
+
+        if (options->generate == GENERATE_WORKER) {
+            for (long long position = my_first; position < my_end;) {
+                int count = get_stream_piece(offsets, position, my_end, &cursor);
+                get_ratings_from_stream_threaded(ratings, count, options->seed, cursor, position - offsets[cursor - 1]);
+                histogram_encoded_ratings_threaded(ENCODING_INT, ratings, count, histograms + (size_t)(cursor - first_product) * RATING_VALUES);
+                position += count;
+            }
+            continue;
+        }
+
+        if (rank == 0) {
+            for (int r = 0; r < size; r++) {
+                long long first = starts[r] + round * chunk_size;
+                long long end = first + chunk_size < ends[r] ? first + chunk_size : ends[r];
+                char *wire = round_buffer + (size_t)r * chunk_size * element_bytes;
+                int units = 0;
+                for (long long position = first; position < end;) {
+                    int count = get_stream_piece(offsets, position, end, &cursors[r]);
+                    int product = cursors[r];
+                    char *piece = wire + (size_t)units * element_bytes;
+                    int *chunk = encoding == ENCODING_INT ? (int *)piece : ratings;
+                    get_product_ratings(options, chunk, product, position - offsets[product - 1], count);
+                    encode_ratings(encoding, chunk, count, piece);
+                    units += get_encoded_count(encoding, count);
+                    position += count;
+                }
+                send_counts[r] = units;
+                displacements[r] = (int)((long long)r * chunk_size);
+            }
+        }
+
+        int my_units = my_first < my_end ? get_stream_units(encoding, offsets, my_first, my_end, cursor) : 0;
+        PROFILE_BEGIN(PROFILE_COLLECTIVE);
+        MPI_Scatterv(round_buffer, send_counts, displacements, wire_type, segment, my_units, wire_type, 0, MPI_COMM_WORLD);
+        PROFILE_END(PROFILE_COLLECTIVE);
+        if (rank == 0) {
+            long long units = 0;
+            for (int r = 0; r < size; r++) {
+                units += send_counts[r];
+            }
+            PROFILE_SEND(units * (long long)element_bytes);
+        }
+
+        int units = 0;
+        for (long long position = my_first; position < my_end;) {
+            int count = get_stream_piece(offsets, position, my_end, &cursor);
+            histogram_encoded_ratings_threaded(encoding, segment + (size_t)units * element_bytes, count, histograms + (size_t)(cursor - first_product) * RATING_VALUES);
+            units += get_encoded_count(encoding, count);
+            position += count;
+        }
+    }
+
+    // Rank 0 learns which products each rank touched and gathers all the histograms, partial ones included
+    int placement[2] = {first_product, touched};
+    int *placements = NULL;
+    int *histogram_counts = NULL;
+    int *histogram_displacements = NULL;
+    long long *gathered = NULL;
+    if (rank == 0) {
+        placements = (int *)malloc(2 * (size_t)size * sizeof(int));
+        histogram_counts = (int *)malloc(size * sizeof(int));
+        histogram_displacements = (int *)malloc(size * sizeof(int));
+    }
+    PROFILE_BEGIN(PROFILE_COLLECTIVE);
+    MPI_Gather(placement, 2, MPI_INT, placements, 2, MPI_INT, 0, MPI_COMM_WORLD);
+    PROFILE_END(PROFILE_COLLECTIVE);
+    if (rank == 0) {
+        for (int r = 0; r < size; r++) {
+            histogram_counts[r] = placements[2 * r + 1] * RATING_VALUES;
+            histogram_displacements[r] = r == 0 ? 0 : histogram_displacements[r - 1] + histogram_counts[r - 1];
+        }
+        gathered = (long long *)malloc(((size_t)histogram_displacements[size - 1] + histogram_counts[size - 1]) * sizeof(long long));
+    }
+    PROFILE_BEGIN(PROFILE_COLLECTIVE);
+    MPI_Gatherv(histograms, touched * RATING_VALUES, MPI_LONG_LONG, gathered, histogram_counts, histogram_displacements, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+    PROFILE_END(PROFILE_COLLECTIVE);
+    PROFILE_SEND((long long)touched * RATING_VALUES * sizeof(long long));
 
+    if (rank == 0) {
+        // A product is credited to the first rank whose range holds its ratings
+        long long *merged = (long long *)calloc((size_t)m * RATING_VALUES, sizeof(long long));
+        int *owners = (int *)malloc(m * sizeof(int));
+        for (int i = 0; i < m; i++) {
+            owners[i] = -1;
+        }
+        for (int r = 0; r < size; r++) {
+            for (int j = 0; j < placements[2 * r + 1]; j++) {
+                int product = placements[2 * r] + j;
+                const long long *partial = gathered + histogram_displacements[r] + (size_t)j * RATING_VALUES;
+                for (int v = 0; v < RATING_VALUES; v++) {
+                    merged[(size_t)(product - 1) * RATING_VALUES + v] += partial[v];
+                }
+                if (owners[product - 1] < 0) {
+                    owners[product - 1] = r;
+                }
+            }
+        }
         for (int i = 0; i < m; i++) {
-            get_ratings(ratings, n);
+            score_histogram(options, merged + (size_t)i * RATING_VALUES, owners[i], i + 1, &ratings_to_rank_averages[i]);
+        }
+        free(owners);
+        free(merged);
+    }
+
+    free(gathered);
+    free(histogram_displacements);
+    free(histogram_counts);
+    free(placements);
+    free(cursors);
+    free(displacements);
+    free(send_counts);
+    free(round_buffer);
+    free(segment);
+    free(ratings);
+    free(histograms);
+    free(ends);
+    free(starts);
+    free(offsets);
+}
+
+/*
+Shared-memory path (--path=shared): the collective path's rounds, but the ranks of a node read their ratings in
+place from one MPI-3 shared-memory window per node instead of each receiving a private copy.
+
+MPI_COMM_WORLD is split into one communicator per node with MPI_Comm_split_type(MPI_COMM_TYPE_SHARED). The
+node's first rank (its leader) allocates the node's segment with MPI_Win_allocate_shared and the other ranks
+map it with MPI_Win_shared_query. The segment has one slot per rank of the node, holding that rank's products
+of the current round one chunk each. For every chunk rank 0 generates straight into its own node's segment and
+sends each other node's slots to that node's leader in a single message, so a chunk crosses the network once
+per node and is never copied between the ranks of a node. Barriers on the node communicator, with MPI_Win_sync
+for the memory model, separate filling a segment from reading it.
+*/
+
+// Rank 0's view of the nodes: node x's ranks are members[first_member[x]] onwards, in node order, leader first
+struct NodeMap {
+    int count;
+    int *sizes;
+    int *first_member;
+    int *members;
+};
+
+// Collective over MPI_COMM_WORLD, only rank 0's map is filled
+void get_node_map(int node_index, int node_rank, int rank, int size, struct NodeMap *map) {
+    int placement[2] = {node_index, node_rank};
+    int *placements = rank == 0 ? (int *)malloc(2 * (size_t)size * sizeof(int)) : NULL;
+    MPI_Gather(placement, 2, MPI_INT, placements, 2, MPI_INT, 0, MPI_COMM_WORLD);
+    map->count = 0;
+    map->sizes = map->first_member = map->members = NULL;
+    if (rank != 0) {
+        return;
+    }
+
+    for (int r = 0; r < size; r++) {
+        if (placements[2 * r] + 1 > map->count) {
+            map->count = placements[2 * r] + 1;
+        }
+    }
+    map->sizes = (int *)calloc(map->count, sizeof(int));
+    map->first_member = (int *)malloc(map->count * sizeof(int));
+    map->members = (int *)malloc(size * sizeof(int));
+    for (int r = 0; r < size; r++) {
+        map->sizes[placements[2 * r]]++;
+    }
+    map->first_member[0] = 0;
+    for (int x = 1; x < map->count; x++) {
+        map->first_member[x] = map->first_member[x - 1] + map->sizes[x - 1];
+    }
+    for (int r = 0; r < size; r++) {
+        map->members[map->first_member[placements[2 * r]] + placements[2 * r + 1]] = r;
+    }
+    free(placements);
+}
+
+void free_node_map(struct NodeMap *map) {
+    free(map->sizes);
+    free(map->first_member);
+    free(map->members);
+}
+
+// Returns the number of results rank 0 received, m or at most --top
+int run_shared(struct Options *options, int rank, int size, struct RatingToRank *ratings_to_rank_averages) {
+    int m = options->m;
+    long long n = options->n;
+    int chunk_size = options->chunk_size;
+    enum Encoding encoding = options->encoding;
+    size_t element_bytes = get_encoding_element_bytes(encoding);
+
+    int per_rank = get_products_per_rank(options, size);
+    int round_products = per_rank * size;
+    int rounds = (m + round_products - 1) / round_products;
+    int step_ratings = n < chunk_size ? (int)n : chunk_size;
+    int step_units = get_encoded_count(encoding, step_ratings);
+    size_t slot_bytes = (size_t)per_rank * step_units * element_bytes;
+
+    // Key by world rank so rank 0 leads its node and node order follows world rank order
+    MPI_Comm node_comm, leader_comm;
+    int node_rank, node_size, node_index = 0;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_rank(node_comm, &node_rank);
+    MPI_Comm_size(node_comm, &node_size);
+    MPI_Comm_split(MPI_COMM_WORLD, node_rank == 0 ? 0 : MPI_UNDEFINED, rank, &leader_comm);
+    if (leader_comm != MPI_COMM_NULL) {
+        MPI_Comm_rank(leader_comm, &node_index);
+        MPI_Comm_free(&leader_comm);
+    }
+    MPI_Bcast(&node_index, 1, MPI_INT, 0, node_comm);
+
+    struct NodeMap nodes;
+    get_node_map(node_index, node_rank, rank, size, &nodes);
+
+    MPI_Win window;
+    char *segment;
+    MPI_Aint segment_bytes;
+    int displacement_unit;
+    MPI_Win_allocate_shared(node_rank == 0 ? (MPI_Aint)(node_size * slot_bytes) : 0, 1, MPI_INFO_NULL, node_comm, &segment, &window);
+    MPI_Win_shared_query(window, 0, &segment_bytes, &displacement_unit, &segment);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, window);
+
+    // One slot per message element, so the count of a node's message is its rank count however large a slot is
+    MPI_Datatype slot_type;
+    MPI_Type_contiguous((int)(slot_bytes / element_bytes), get_encoding_datatype(encoding), &slot_type);
+    MPI_Type_commit(&slot_type);
+
+    int *ratings = NULL;
+    char *staging = NULL; // other nodes' slots on rank 0
+    if (rank == 0) {
+        int largest_node = 0;
+        for (int x = 0; x < nodes.count; x++) {
+            largest_node = nodes.sizes[x] > largest_node ? nodes.sizes[x] : largest_node;
+        }
+        ratings = (int *)malloc(step_ratings * sizeof(int));
+        staging = nodes.count > 1 ? (char *)malloc(largest_node * slot_bytes) : NULL;
+    }
+
+    long long *histograms = (long long *)malloc((size_t)per_rank * RATING_VALUES * sizeof(long long));
+    struct RatingToRank *local_results = (struct RatingToRank *)malloc((size_t)rounds * per_rank * sizeof(struct RatingToRank));
+    int local_count = 0;
+    char *my_slot = segment + node_rank * slot_bytes;
+
+    for (int round_first = 1; round_first <= m; round_first += round_products) {
+        int my_first = round_first + rank * per_rank;
+        int my_products = m - my_first + 1 < per_rank ? m - my_first + 1 : per_rank;
+        if (my_products < 0) {
+            my_products = 0;
+        }
+        for (int j = 0; j < per_rank * RATING_VALUES; j++) {
+            histograms[j] = 0;
+        }
+
+        for (long long first = 0; first < n; first += chunk_size) {
+            int count = get_chunk_count(n, first, chunk_size);
+
+            // Nobody on the node may still be reading the previous chunk when the segment is refilled
+            PROFILE_BEGIN(PROFILE_COLLECTIVE);
+            MPI_Barrier(node_comm);
+            PROFILE_END(PROFILE_COLLECTIVE);
+
+            if (rank == 0) {
+                for (int x = 0; x < nodes.count; x++) {
+                    char *slots = x == node_index ? segment : staging;
+                    for (int member = 0; member < nodes.sizes[x]; member++) {
+                        int first_product = round_first + nodes.members[nodes.first_member[x] + member] * per_rank;
+                        int products = m - first_product + 1 < per_rank ? m - first_product + 1 : per_rank;
+                        for (int j = 0; j < products; j++) {
+                            char *wire = slots + member * slot_bytes + (size_t)j * step_units * element_bytes;
+                            int *chunk = encoding == ENCODING_INT ? (int *)wire : ratings;
+                            get_product_ratings(options, chunk, first_product + j, first, count);
+                            encode_ratings(encoding, chunk, count, wire);
+                        }
+                    }
+                    if (x != node_index) {
+                        PROFILE_BEGIN(PROFILE_SEND);
+                        MPI_Send(staging, nodes.sizes[x], slot_type, nodes.members[nodes.first_member[x]], TAG_RATINGS, MPI_COMM_WORLD);
+                        PROFILE_END(PROFILE_SEND);
+                        PROFILE_SEND(nodes.sizes[x] * (long long)slot_bytes);
+                    }
+                }
+            } else if (node_rank == 0) {
+                PROFILE_BEGIN(PROFILE_RECEIVE);
+                MPI_Recv(segment, node_size, slot_type, 0, TAG_RATINGS, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                PROFILE_END(PROFILE_RECEIVE);
+            }
+
+            // The leader's stores become visible to the node before anyone reads
+            PROFILE_BEGIN(PROFILE_COLLECTIVE);
+            MPI_Win_sync(window);
+            MPI_Barrier(node_comm);
+            MPI_Win_sync(window);
+            PROFILE_END(PROFILE_COLLECTIVE);
+
+            for (int j = 0; j < my_products; j++) {
+                histogram_encoded_ratings_threaded(encoding, my_slot + (size_t)j * step_units * element_bytes, count, histograms + j * RATING_VALUES);
+            }
+        }
+
+        for (int j = 0; j < my_products; j++) {
+            score_histogram(options, histograms + j * RATING_VALUES, rank, my_first + j, &local_results[local_count++]);
+        }
+    }
+
+    MPI_Win_unlock_all(window);
+    MPI_Win_free(&window);
+    MPI_Type_free(&slot_type);
+    MPI_Comm_free(&node_comm);
+    free_node_map(&nodes);
+
+    int result_count = collect_local_results(options, local_results, local_count, rank, size, ratings_to_rank_averages);
+
+    free(local_results);
+    free(histograms);
+    free(staging);
+    free(ratings);
+    return result_count;
+}
+
+/*
+One-sided path (--path=rma): the workers pull their work out of windows on rank 0 and push their results back
+into them, so rank 0 only generates and never takes part in a message.
+
+The work is the list of (product, chunk) units, product 1's chunks first. Rank 0 exposes two windows:
+- ratings: two halves of round_units chunk slots each. Round r of units is generated into half r % 2, so rank 0
+  fills the next round while the workers are still fetching the current one
+- control: four counters (next unit to claim, units published, units fetched from each half) followed by m
+  histograms
+
+A round holds the collective path's segment budget for every worker, so small products travel many to a round.
+Every rank holds a passive-target MPI_Win_lock_all epoch on both windows for the whole run. A worker claims a
+batch of consecutive units (about 1 / BATCHES_PER_WORKER of its share of a round) with one MPI_Fetch_and_op,
+waits until rank 0 has published them, copies their slots out with one MPI_Get (two when the batch wraps around
+the end of the window), counts them as fetched and counts them. Units are in product order, so a batch covers a
+contiguous run of products and its histograms are added into rank 0's with a single MPI_Accumulate. A product
+split across batches or workers needs no merging step. Rank 0 only waits before it refills a half, until every unit of the round that used it has been
+fetched. Fetches are counted per half because a slow worker may still hold a unit of the older round while the
+others are already fetching the newer one. The counters are read with MPI_Fetch_and_op(MPI_NO_OP) and written with MPI_Accumulate, which are
+atomic with respect to each other, and MPI_Win_flush completes each operation before the next one depends on
+it. MPI_Win_free completes every accumulate before rank 0 scores the histograms.
+*/
+#define RMA_NEXT_UNIT 0
+#define RMA_PUBLISHED_UNITS 1
+#define RMA_FETCHED_UNITS 2 // one counter per half
+#define RMA_COUNTERS 4
+
+// Reads one of rank 0's counters atomically
+long long read_rma_counter(MPI_Win control, int counter) {
+    long long value;
+    MPI_Fetch_and_op(NULL, &value, MPI_LONG_LONG, 0, counter, MPI_NO_OP, control);
+    MPI_Win_flush(0, control);
+    return value;
+}
+
+// Adds a worker's histograms of products first_product onwards into rank 0's
+void accumulate_rma_histograms(MPI_Win control, int first_product, int products, long long *histograms) {
+    int count = products * RATING_VALUES;
+    PROFILE_BEGIN(PROFILE_SEND);
+    MPI_Accumulate(histograms, count, MPI_LONG_LONG, 0, RMA_COUNTERS + (MPI_Aint)(first_product - 1) * RATING_VALUES, count, MPI_LONG_LONG, MPI_SUM, control);
+    MPI_Win_flush(0, control);
+    PROFILE_END(PROFILE_SEND);
+    PROFILE_SEND((long long)count * sizeof(long long));
+}
+
+void run_rma(struct Options *options, int rank, int size, struct RatingToRank *ratings_to_rank_averages) {
+    int m = options->m;
+    long long n = options->n;
+    int chunk_size = options->chunk_size;
+    enum Encoding encoding = options->encoding;
+    MPI_Datatype wire_type = get_encoding_datatype(encoding);
+    size_t element_bytes = get_encoding_element_bytes(encoding);
+
+    long long chunks = (n + chunk_size - 1) / chunk_size;
+    long long total_units = (long long)m * chunks;
+    int step_ratings = n < chunk_size ? (int)n : chunk_size;
+    int step_units = get_encoded_count(encoding, step_ratings);
+    size_t slot_bytes = (size_t)step_units * element_bytes;
+    // A round gives every worker as many units as the collective path would give it products
+    long long round_units = (long long)get_products_per_rank(options, size - 1) * (size - 1);
+    if (round_units > total_units) {
+        round_units = total_units;
+    }
+    int claim_units = (int)(round_units / ((long long)(size - 1) * BATCHES_PER_WORKER));
+    if (claim_units < 1) {
+        claim_units = 1;
+    }
+
+    char *slots = NULL;
+    long long *control_memory = NULL;
+    size_t control_count = 0;
+    if (rank == 0) {
+        slots = (char *)malloc(2 * (size_t)round_units * slot_bytes);
+        control_count = RMA_COUNTERS + (size_t)m * RATING_VALUES;
+        control_memory = (long long *)calloc(control_count, sizeof(long long));
+    }
+    MPI_Win ratings_window, control;
+    MPI_Win_create(slots, rank == 0 ? (MPI_Aint)(2 * round_units * slot_bytes) : 0, (int)element_bytes, MPI_INFO_NULL, MPI_COMM_WORLD, &ratings_window);
+    MPI_Win_create(control_memory, (MPI_Aint)(control_count * sizeof(long long)), sizeof(long long), MPI_INFO_NULL, MPI_COMM_WORLD, &control);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, ratings_window);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, control);
+
+    if (rank == 0) {
+        int *ratings = (int *)malloc(step_ratings * sizeof(int));
+        for (long long round_first = 0; round_first < total_units; round_first += round_units) {
+            long long round_last = round_first + round_units < total_units ? round_first + round_units : total_units;
+            // The half is free once every earlier round that used it has been fetched, all of them full rounds
+            long long round = round_first / round_units;
+            int half = (int)(round % 2);
+            PROFILE_BEGIN(PROFILE_SEND);
+            while (read_rma_counter(control, RMA_FETCHED_UNITS + half) < round / 2 * round_units) {
+            }
+            PROFILE_END(PROFILE_SEND);
 
-            /* Following print is used to help in verifying the output of the program */
-            // printf("Worker %d's first 10 ratings for product %d are: ", rank, i+1);
-            // for (int j = 0; j < 10; j++) {  // Print first 10 ratings
-            //     printf("%d ", ratings[j]);
-            // }
-            // printf("\n");
+            for (long long unit = round_first; unit < round_last; unit++) {
+                long long first = unit % chunks * chunk_size;
+                int count = get_chunk_count(n, first, chunk_size);
+                char *wire = slots + (size_t)(unit % (2 * round_units)) * slot_bytes;
+                int *chunk = encoding == ENCODING_INT ? (int *)wire : ratings;
+                get_product_ratings(options, chunk, (int)(unit / chunks) + 1, first, count);
+                encode_ratings(encoding, chunk, count, wire);
+            }
 
-            MPI_Send(ratings, n, MPI_INT, i + 1, 0, MPI_COMM_WORLD);
+            // The chunks must reach the window's public copy before the count that lets the workers read them
+            MPI_Win_sync(ratings_window);
+            MPI_Accumulate(&round_last, 1, MPI_LONG_LONG, 0, RMA_PUBLISHED_UNITS, 1, MPI_LONG_LONG, MPI_REPLACE, control);
+            MPI_Win_flush(0, control);
+            PROFILE_SEND((round_last - round_first) * (long long)slot_bytes);
         }
+        free(ratings);
+    } else {
+        char *wire = (char *)malloc((size_t)claim_units * slot_bytes);
+        // A batch touches at most claim_units products, plus one when it starts inside a product
+        long long *histograms = (long long *)malloc(((size_t)claim_units + 1) * RATING_VALUES * sizeof(long long));
+        long long claim = claim_units, published = 0;
+        long long window_units = 2 * round_units;
+        while (1) {
+            long long first_unit;
+            PROFILE_BEGIN(PROFILE_RECEIVE);
+            MPI_Fetch_and_op(&claim, &first_unit, MPI_LONG_LONG, 0, RMA_NEXT_UNIT, MPI_SUM, control);
+            MPI_Win_flush(0, control);
+            PROFILE_END(PROFILE_RECEIVE);
+            if (first_unit >= total_units) {
+                break;
+            }
+            long long last_unit = first_unit + claim < total_units ? first_unit + claim : total_units;
+            int units = (int)(last_unit - first_unit);
+
+            // A batch is never longer than a round, so it is in at most two rounds and wraps the window at most once
+            PROFILE_BEGIN(PROFILE_RECEIVE);
+            while (published < last_unit) {
+                published = read_rma_counter(control, RMA_PUBLISHED_UNITS);
+            }
+            long long first_slot = first_unit % window_units;
+            int before_wrap = first_slot + units <= window_units ? units : (int)(window_units - first_slot);
+            MPI_Get(wire, before_wrap * step_units, wire_type, 0, (MPI_Aint)first_slot * step_units, before_wrap * step_units, wire_type, ratings_window);
+            if (before_wrap < units) {
+                MPI_Get(wire + (size_t)before_wrap * slot_bytes, (units - before_wrap) * step_units, wire_type, 0, 0, (units - before_wrap) * step_units, wire_type, ratings_window);
+            }
+            MPI_Win_flush(0, ratings_window);
+            long long fetched[2] = {0, 0};
+            for (long long unit = first_unit; unit < last_unit; unit++) {
+                fetched[unit / round_units % 2]++;
+            }
+            for (int half = 0; half < 2; half++) {
+                if (fetched[half] > 0) {
+                    MPI_Accumulate(&fetched[half], 1, MPI_LONG_LONG, 0, RMA_FETCHED_UNITS + half, 1, MPI_LONG_LONG, MPI_SUM, control);
+                }
+            }
+            MPI_Win_flush(0, control);
+            PROFILE_END(PROFILE_RECEIVE);
+
+            int first_product = (int)(first_unit / chunks) + 1;
+            int products = (int)((last_unit - 1) / chunks) + 2 - first_product;
+            memset(histograms, 0, (size_t)products * RATING_VALUES * sizeof(long long));
+            for (long long unit = first_unit; unit < last_unit; unit++) {
+                int product = (int)(unit / chunks) + 1;
+                int count = get_chunk_count(n, unit % chunks * chunk_size, chunk_size);
+                histogram_encoded_ratings_threaded(encoding, wire + (size_t)(unit - first_unit) * slot_bytes, count, histograms + (size_t)(product - first_product) * RATING_VALUES);
+            }
+            accumulate_rma_histograms(control, first_product, products, histograms);
+        }
+        free(histograms);
+        free(wire);
+    }
 
+    MPI_Win_unlock_all(ratings_window);
+    MPI_Win_unlock_all(control);
+    MPI_Win_free(&ratings_window);
+    MPI_Win_free(&control);
+
+    if (rank == 0) {
         for (int i = 0; i < m; i++) {
-            MPI_Recv(&ratings_to_rank_averages[i], 2, MPI_DOUBLE, i + 1, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            score_histogram(options, control_memory + RMA_COUNTERS + (size_t)i * RATING_VALUES, 0, i + 1, &ratings_to_rank_averages[i]);
+        }
+    }
+    free(control_memory);
+    free(slots);
+}
+
+/*
+Service mode: a long-lived ranking service fed with a stream of new ratings.
+
+The products are split into one contiguous block per worker. Each worker scores its block's n initial ratings
+once and from then on keeps a running histogram per product, so a batch of new ratings only touches the
+products it rates. Rank 0 produces --service batches of --delta ratings and routes every rating to the worker
+that owns its product.
+
+A batch holds a fixed share of ratings for each worker (its products are drawn from that worker's block), so
+every message has the same length in every batch. That lets rank 0 set up one persistent send per worker with
+MPI_Send_init and each worker one persistent receive with MPI_Recv_init, and a batch is just MPI_Startall on
+rank 0 and MPI_Start on the workers.
+
+Each worker keeps its products in a max-heap with a position index (best product at the root). A batch
+re-scores the touched products from their histograms and moves them up or down the heap, and the worker's top k is read
+off the heap without scanning the block. The top k lists are merged on rank 0 with gather_top_k after every
+batch, so a batch costs O(delta log m + k * ranks) and does not grow with the number of ratings seen so far.
+*/
+
+// Swaps two entries of an index heap and keeps positions (when given) pointing at them
+void swap_heap_entries(int *heap, int a, int b, int *positions) {
+    int temporary = heap[a];
+    heap[a] = heap[b];
+    heap[b] = temporary;
+    if (positions != NULL) {
+        positions[heap[a]] = a;
+        positions[heap[b]] = b;
+    }
+}
+
+// heap holds indices into values, the best value at the root
+void sift_up_best_index(int *heap, int index, const struct RatingToRank *values, int *positions) {
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (!is_better_rating(&values[heap[index]], &values[heap[parent]])) {
+            return;
+        }
+        swap_heap_entries(heap, index, parent, positions);
+        index = parent;
+    }
+}
+
+void sift_down_best_index(int *heap, int count, int index, const struct RatingToRank *values, int *positions) {
+    while (1) {
+        int best = index;
+        int left = 2 * index + 1;
+        int right = left + 1;
+        if (left < count && is_better_rating(&values[heap[left]], &values[heap[best]])) {
+            best = left;
         }
+        if (right < count && is_better_rating(&values[heap[right]], &values[heap[best]])) {
+            best = right;
+        }
+        if (best == index) {
+            return;
+        }
+        swap_heap_entries(heap, index, best, positions);
+        index = best;
+    }
+}
+
+// A worker's block of products and their running aggregates
+struct ServiceBlock {
+    int first_product;
+    int product_count;
+    long long *histograms;         // RATING_VALUES bins per product
+    struct RatingToRank *averages; // indexed by product - first_product
+    int *heap;                     // product indices, best average at the root
+    int *positions;                // where each product sits in heap
+    int *touched;                  // products rated in the current batch
+    int *touched_batch;            // last batch that touched each product, so a product is listed once
+    int *candidates;               // frontier of the heap walk in get_block_top_k
+};
+
+// Every worker's product block and batch share are the same split, worker w gets part w - 1
+void get_service_share(int worker, int size, int m, int delta, int *first_product, int *product_count, int *first_rating, int *rating_count) {
+    int workers = size - 1;
+    int owners = m < workers ? m : workers; // workers past m own no products and get no ratings
+    long long start = 0, count = 0;
+    if (worker <= owners) {
+        calculate_start_and_count(worker - 1, owners, m, &start, &count);
+    }
+    *first_product = (int)start + 1;
+    *product_count = (int)count;
+    start = count = 0;
+    if (worker <= owners) {
+        calculate_start_and_count(worker - 1, owners, delta, &start, &count);
+    }
+    *first_rating = (int)start;
+    *rating_count = (int)count;
+}
+
+/*
+Rating i of batch b (counted across the whole batch) comes from one draw of the stream reserved for product
+0, which no real product uses: the high 32 bits pick the product inside the owner's block and the low 16 bits
+the rating. The batches depend on the seed and on the worker count, which fixes the blocks.
+*/
+void get_delta_ratings(int *pairs, int count, uint64_t seed, int batch, int delta, int first_rating, int first_product, int product_count) {
+    uint64_t key = get_rating_stream_key(seed, 0);
+    uint64_t first_draw = (uint64_t)batch * (uint64_t)delta + (uint64_t)first_rating;
+    for (int i = 0; i < count; i++) {
+        uint64_t draw = mix64(key + first_draw + (uint64_t)i);
+        pairs[2 * i] = first_product + (int)(((draw >> 32) * (uint64_t)product_count) >> 32);
+        pairs[2 * i + 1] = (int)(((draw & 0xffff) * 5) >> 16) + 1;
+    }
+}
+
+void allocate_service_block(struct Options *options, struct ServiceBlock *block, int rank, int first_product, int product_count) {
+    long long n = options->n;
+    int chunk_size = get_chunk_size(n);
+    int count = product_count > 0 ? product_count : 1;
+    block->first_product = first_product;
+    block->product_count = product_count;
+    block->histograms = (long long *)calloc((size_t)count * RATING_VALUES, sizeof(long long));
+    block->averages = (struct RatingToRank *)malloc(count * sizeof(struct RatingToRank));
+    block->heap = (int *)malloc(count * sizeof(int));
+    block->positions = (int *)malloc(count * sizeof(int));
+    block->touched = (int *)malloc(count * sizeof(int));
+    block->touched_batch = (int *)malloc(count * sizeof(int));
+    block->candidates = NULL;
+
+    // The history: copied from the block's records in a restored snapshot (already checked by rank 0),
+    // otherwise every product's n initial ratings, generated and counted here once
+    size_t snapshot_bytes = 0;
+    const char *snapshot = options->restore_path != NULL ? map_snapshot(options->restore_path, &snapshot_bytes) : NULL;
+    if (options->restore_path != NULL && snapshot == NULL) {
+        printf("Rank %d could not map snapshot %s\n", rank, options->restore_path);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (snapshot != NULL) {
+        const char *records = snapshot + sizeof(struct SnapshotHeader) + (size_t)(first_product - 1) * RATING_VALUES * sizeof(long long);
+        memcpy(block->histograms, records, (size_t)product_count * RATING_VALUES * sizeof(long long));
+        munmap((void *)snapshot, snapshot_bytes);
+    }
+    int *ratings = (int *)malloc(chunk_size * sizeof(int));
+    for (int i = 0; i < product_count; i++) {
+        long long *histogram = block->histograms + (size_t)i * RATING_VALUES;
+        for (long long first = 0; first < n && options->restore_path == NULL; first += chunk_size) {
+            int chunk = get_chunk_count(n, first, chunk_size);
+            get_ratings_from_stream_threaded(ratings, chunk, options->seed, first_product + i, first);
+            histogram_encoded_ratings_threaded(ENCODING_INT, ratings, chunk, histogram);
+        }
+        score_histogram(options, histogram, rank, first_product + i, &block->averages[i]);
+        block->heap[i] = i;
+        block->positions[i] = i;
+        block->touched_batch[i] = -1;
+    }
+    free(ratings);
+
+    for (int i = product_count / 2 - 1; i >= 0; i--) {
+        sift_down_best_index(block->heap, product_count, i, block->averages, block->positions);
+    }
+}
+
+void free_service_block(struct ServiceBlock *block) {
+    free(block->histograms);
+    free(block->averages);
+    free(block->heap);
+    free(block->positions);
+    free(block->touched);
+    free(block->touched_batch);
+    free(block->candidates);
+}
+
+// Folds one batch of {product, rating} pairs into the block, only the touched products move in the heap
+void apply_delta_ratings(struct Options *options, struct ServiceBlock *block, const int *pairs, int count, int batch) {
+    int touched_count = 0;
+    for (int i = 0; i < count; i++) {
+        int product = pairs[2 * i] - block->first_product;
+        block->histograms[(size_t)product * RATING_VALUES + pairs[2 * i + 1] - 1]++;
+        if (block->touched_batch[product] != batch) {
+            block->touched_batch[product] = batch;
+            block->touched[touched_count++] = product;
+        }
+    }
+
+    for (int i = 0; i < touched_count; i++) {
+        int product = block->touched[i];
+        struct RatingToRank *result = &block->averages[product];
+        score_histogram(options, block->histograms + (size_t)product * RATING_VALUES, result->rank, result->product, result);
+        int position = block->positions[product];
+        sift_up_best_index(block->heap, position, block->averages, block->positions);
+        sift_down_best_index(block->heap, block->product_count, block->positions[product], block->averages, block->positions);
+    }
+}
+
+/*
+Copies the block's k best products into top, best first, and returns how many there are. The k best of a
+heap are found by walking it from the root: a frontier heap starts with the root, and every time its best
+product is taken, that product's two children in the block heap join the frontier. That is O(k log k).
+*/
+int get_block_top_k(struct ServiceBlock *block, int k, struct RatingToRank *top) {
+    if (block->product_count == 0) {
+        return 0;
+    }
+    if (block->candidates == NULL) {
+        block->candidates = (int *)malloc((2 * k + 1) * sizeof(int));
+    }
+
+    int *frontier = block->candidates;
+    int frontier_count = 1;
+    int top_count = 0;
+    frontier[0] = block->heap[0];
+    while (top_count < k && frontier_count > 0) {
+        int product = frontier[0];
+        top[top_count++] = block->averages[product];
+        frontier[0] = frontier[--frontier_count];
+        sift_down_best_index(frontier, frontier_count, 0, block->averages, NULL);
+
+        int left = 2 * block->positions[product] + 1;
+        for (int child = left; child <= left + 1 && child < block->product_count; child++) {
+            frontier[frontier_count++] = block->heap[child];
+            sift_up_best_index(frontier, frontier_count - 1, block->averages, NULL);
+        }
+    }
+    return top_count;
+}
+
+/*
+Writes the snapshot after watermark batches, collective over MPI_COMM_WORLD. Rank 0 writes the header and each
+worker its block's records at the block's place in the file, all in one MPI_File_write_at_all. block is NULL on
+rank 0. Returns nonzero when the file could not be written, the previous snapshot is then left as it was.
+*/
+int write_snapshot(struct Options *options, struct ServiceBlock *block, int watermark, int rank, int size) {
+    char *temporary = (char *)malloc(strlen(options->snapshot_path) + 5);
+    sprintf(temporary, "%s.tmp", options->snapshot_path);
+    MPI_File file;
+    if (MPI_File_open(MPI_COMM_WORLD, temporary, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS) {
+        free(temporary);
+        return 1;
+    }
+
+    MPI_Datatype record_type;
+    MPI_Type_contiguous(RATING_VALUES, MPI_LONG_LONG, &record_type);
+    MPI_Type_commit(&record_type);
+    MPI_Offset records_offset = sizeof(struct SnapshotHeader);
+    MPI_Offset record_bytes = RATING_VALUES * sizeof(long long);
+    // Drops whatever an older, larger file left behind
+    MPI_File_set_size(file, records_offset + options->m * record_bytes);
+
+    int error;
+    if (rank == 0) {
+        struct SnapshotHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.record_values = RATING_VALUES;
+        header.m = (uint64_t)options->m;
+        header.n = (uint64_t)options->n;
+        header.seed = options->seed;
+        header.watermark = (uint64_t)watermark;
+        header.delta = (uint64_t)options->delta;
+        header.workers = (uint64_t)(size - 1);
+        error = MPI_File_write_at_all(file, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
+    } else {
+        error = MPI_File_write_at_all(file, records_offset + (block->first_product - 1) * record_bytes, block->histograms, block->product_count, record_type, MPI_STATUS_IGNORE);
+    }
+    MPI_File_close(&file);
+    MPI_Type_free(&record_type);
+
+    // Only once every rank's part is in is the new file allowed to replace the last good snapshot
+    int failed = error != MPI_SUCCESS, any_failed;
+    MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (rank == 0 && !any_failed && rename(temporary, options->snapshot_path) != 0) {
+        any_failed = 1;
+    }
+    free(temporary);
+    return any_failed;
+}
+
+// Whether a snapshot is due after batch index batch
+int is_snapshot_batch(struct Options *options, int batch) {
+    return options->snapshot_path != NULL && ((batch + 1) % options->snapshot_every == 0 || batch + 1 == options->service_batches);
+}
+
+// Returns the number of results in ratings_to_rank_averages, the final top k
+int run_service_master(struct Options *options, int size, struct RatingToRank *ratings_to_rank_averages) {
+    int m = options->m;
+    int delta = options->delta;
+    int k = options->top_k;
+    int *pairs = (int *)malloc(2 * (size_t)delta * sizeof(int));
+    MPI_Request *requests = (MPI_Request *)malloc((size - 1) * sizeof(MPI_Request));
+
+    // One persistent send per worker, each over its own slice of pairs
+    for (int worker = 1; worker < size; worker++) {
+        int first_product, product_count, first_rating, rating_count;
+        get_service_share(worker, size, m, delta, &first_product, &product_count, &first_rating, &rating_count);
+        MPI_Send_init(pairs + 2 * (size_t)first_rating, 2 * rating_count, MPI_INT, worker, TAG_DELTA, MPI_COMM_WORLD, &requests[worker - 1]);
+    }
+
+    // Workers score their history before the first batch, so it is not counted in the first batch's latency
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    if (options->restore_path != NULL) {
+        printf("Restored %s after batch %d\n", options->restore_path, options->watermark);
+    }
+
+    int result_count = 0;
+    double total_latency = 0.0;
+    double max_latency = 0.0;
+    for (int batch = options->watermark; batch < options->service_batches; batch++) {
+        double batch_start = MPI_Wtime();
+        for (int worker = 1; worker < size; worker++) {
+            int first_product, product_count, first_rating, rating_count;
+            get_service_share(worker, size, m, delta, &first_product, &product_count, &first_rating, &rating_count);
+            int *worker_pairs = pairs + 2 * (size_t)first_rating;
+            get_delta_ratings(worker_pairs, rating_count, options->seed, batch, delta, first_rating, first_product, product_count);
+            PROFILE_SEND(2 * (long long)rating_count * sizeof(int));
+        }
+        PROFILE_BEGIN(PROFILE_SEND);
+        MPI_Startall(size - 1, requests);
+        MPI_Waitall(size - 1, requests, MPI_STATUSES_IGNORE);
+        PROFILE_END(PROFILE_SEND);
+
+        result_count = gather_top_k(NULL, 0, k, 0, size, ratings_to_rank_averages);
+        double latency = MPI_Wtime() - batch_start;
+        total_latency += latency;
+        if (latency > max_latency) {
+            max_latency = latency;
+        }
+        printf("Batch %d: %'d ratings, best product %d (%.4f), latency %.6f seconds\n", batch + 1, delta, ratings_to_rank_averages[0].product, ratings_to_rank_averages[0].score, latency);
+
+        if (is_snapshot_batch(options, batch)) {
+            double snapshot_start = MPI_Wtime();
+            if (write_snapshot(options, NULL, batch + 1, 0, size)) {
+                printf("Snapshot %s could not be written, the previous one is kept\n", options->snapshot_path);
+            } else {
+                printf("Snapshot after batch %d written to %s in %.6f seconds\n", batch + 1, options->snapshot_path, MPI_Wtime() - snapshot_start);
+            }
+        }
+    }
+    printf("Batch latency: mean %.6f seconds, max %.6f seconds\n", total_latency / (options->service_batches - options->watermark), max_latency);
+
+    for (int worker = 1; worker < size; worker++) {
+        MPI_Request_free(&requests[worker - 1]);
+    }
+    free(requests);
+    free(pairs);
+    return result_count;
+}
+
+void run_service_worker(struct Options *options, int rank, int size) {
+    int k = options->top_k;
+    int first_product, product_count, first_rating, rating_count;
+    get_service_share(rank, size, options->m, options->delta, &first_product, &product_count, &first_rating, &rating_count);
+
+    struct ServiceBlock block;
+    allocate_service_block(options, &block, rank, first_product, product_count);
+    int *pairs = (int *)malloc((2 * (size_t)rating_count + 1) * sizeof(int));
+    struct RatingToRank *top = (struct RatingToRank *)malloc(k * sizeof(struct RatingToRank));
+    MPI_Request request;
+    MPI_Recv_init(pairs, 2 * rating_count, MPI_INT, 0, TAG_DELTA, MPI_COMM_WORLD, &request);
+
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    for (int batch = options->watermark; batch < options->service_batches; batch++) {
+        PROFILE_BEGIN(PROFILE_RECEIVE);
+        MPI_Start(&request);
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+        PROFILE_END(PROFILE_RECEIVE);
+        apply_delta_ratings(options, &block, pairs, rating_count, batch);
+
+        int top_count = get_block_top_k(&block, k, top);
+        gather_top_k(top, top_count, k, rank, size, NULL);
+
+        if (is_snapshot_batch(options, batch)) {
+            write_snapshot(options, &block, batch + 1, rank, size);
+        }
+    }
+
+    MPI_Request_free(&request);
+    free(top);
+    free(pairs);
+    free_service_block(&block);
+}
+
+int main(int argc, char **argv) {
+    setlocale(LC_ALL, "");
+
+    int rank, size, provided;
+    struct Options options;
+    // Threads only compute, all MPI calls stay on the main thread
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    // Parse command line arguments
+    if (is_argument_error(argc, argv, rank, size, &options)) {
+        return 1;
+    }
+
+#ifdef _OPENMP
+    if (provided < MPI_THREAD_FUNNELED) {
+        if (rank == 0) {
+            printf("This MPI library does not support MPI_THREAD_FUNNELED, running one thread per rank\n");
+        }
+        omp_set_num_threads(1);
+    }
+#else
+    (void)provided;
+#endif
+
+    int m = options.m;
+
+    if (options.bench_kernels) { // Only the histogram microbenchmark, on rank 0
+        if (rank == 0) {
+            run_kernel_benchmark(&options);
+        }
+        MPI_Finalize();
+        return 0;
+    }
+
+    create_rating_to_rank_type();
+#ifdef RATINGS_PROFILE
+    profile_start(options.trace_prefix);
+#endif
+
+    struct RatingToRank *ratings_to_rank_averages = NULL;
+    if (rank == 0) {
+        ratings_to_rank_averages = (struct RatingToRank *)malloc(m * sizeof(struct RatingToRank));
+        srand(time(NULL));
+
+        if (options.use_counter_rng && options.input_path == NULL) {
+            printf("Ratings seed: %llu\n", (unsigned long long)options.seed);
+        }
+    }
+
+    double start_time = 0.0;
+    if (options.timing) {
+        MPI_Barrier(MPI_COMM_WORLD);
+        start_time = MPI_Wtime();
+    }
 
+    int error = 0;
+    int result_count = m; // results rank 0 holds, fewer than m when --top was merged across ranks
+    if (options.input_path != NULL) { // Every rank reads its own part of the input file
+        error = read_ratings_file(&options, rank, size, ratings_to_rank_averages);
+    } else if (options.service_batches > 0) { // Workers keep running aggregates, rank 0 streams batches to them
+        if (rank == 0) {
+            result_count = run_service_master(&options, size, ratings_to_rank_averages);
+        } else {
+            run_service_worker(&options, rank, size);
+        }
+    } else if (options.path == PATH_COLLECTIVE && options.product_ratings != NULL) { // Every rank takes an even range of all the ratings
+        run_partitioned(&options, rank, size, ratings_to_rank_averages);
+    } else if (options.path == PATH_COLLECTIVE) { // Every rank takes part in the scatters and the gather
+        result_count = run_collective(&options, rank, size, ratings_to_rank_averages);
+    } else if (options.path == PATH_SHARED) { // Every rank reads its products from its node's shared window
+        result_count = run_shared(&options, rank, size, ratings_to_rank_averages);
+    } else if (options.path == PATH_RMA) { // Workers fetch chunks from and add histograms into rank 0's windows
+        run_rma(&options, rank, size, ratings_to_rank_averages);
+    } else if (rank == 0) { // Master process
+        if (options.schedule == SCHEDULE_DYNAMIC) {
+            result_count = run_dynamic_master(&options, size, ratings_to_rank_averages);
+        } else {
+            run_static_master(&options, ratings_to_rank_averages);
+        }
+    } else if (options.schedule == SCHEDULE_DYNAMIC) { // Worker processes pulling from the queue
+        run_dynamic_worker(&options, rank, size);
+    } else if (rank <= m) { // Worker processes, one product each
+        run_static_worker(&options, rank);
+    }
+
+    if (rank == 0 && !error) {
         /* Following print is used to help in verifying the output of the program by being able to see what the average ratings are before they are sorted to ensure that the sorting algorithm is working correctly */
         // printf("Unsorted ratings:\n");
         // for (int i = 0; i < m; i++) {
-        //     printf("%d: %.1f\n", ratings_to_rank_averages[i].rank, ratings_to_rank_averages[i].average_rating);
+        //     printf("%d: %.1f\n", ratings_to_rank_averages[i].product, ratings_to_rank_averages[i].average_rating);
         // }
         // printf("\n");
 
-        sort(ratings_to_rank_averages, m);
+        int top_k = options.top_k > 0 ? options.top_k : result_count;
+        result_count = keep_top_k(ratings_to_rank_averages, result_count, top_k);
 
-        printf("\nSorted Product Ratings:\n\n");
-        for (int i = 0; i < m; i++) {
-            printf("╔══════════════════════════════════════╗\n");
-            printf("║           Product Rating %d           ║\n", i + 1);
-            printf("╠══════════════════════════════════════╣\n");
-            printf("║ Worker:         %-20d ║\n", ratings_to_rank_averages[i].rank);
-            printf("║ Product:        %-20d ║\n", ratings_to_rank_averages[i].rank);
-            printf("║ Average Rating: %-20.4f ║\n", ratings_to_rank_averages[i].average_rating);
-            printf("║ Ratings:        %-'20d ║\n", n);
-            printf("╚══════════════════════════════════════╝\n\n");
+        if (options.timing) {
+            printf("Elapsed time: %.6f seconds\n", MPI_Wtime() - start_time);
         }
 
-        free(ratings);
-        free(ratings_to_rank_averages);
-    } else if (rank <= m) { // Worker processes
-        int *ratings = (int *)malloc(n * sizeof(int));
-        MPI_Recv(ratings, n, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-
-        double average = get_average_for_ratings(ratings, n);
-
-        struct RatingToRank result = {average, rank};
-        MPI_Send(&result, 2, MPI_DOUBLE, 0, 1, MPI_COMM_WORLD);
-
-        free(ratings);
+        PROFILE_BEGIN(PROFILE_PRINT);
+        print_sorted_ratings(&options, ratings_to_rank_averages, result_count);
+        PROFILE_END(PROFILE_PRINT);
     }
 
+#ifdef RATINGS_PROFILE
+    profile_report(rank, size);
+#endif
+
+    free(ratings_to_rank_averages);
+    free(options.product_ratings);
+    MPI_Type_free(&rating_to_rank_type);
     MPI_Finalize();
-    return 0;
-}
\ No newline at end of file
+    return error;
+}
@@ -0,0 +1,315 @@
+#!/usr/bin/env bash
+#
+# Benchmark driver for OnlineRatings, summation, broadcast and gather.
+#
+# Builds the four programs, sweeps ranks x m x n (OnlineRatings), ranks x n (summation) and ranks x message
+# size (broadcast, gather), and writes every timing to CSV and JSON together with a cold/warm summary.
+#
+# Every time comes from the program itself: MPI_Wtime measured after a barrier (OnlineRatings --timing,
+# summation's "Elapsed time" line, the benchmark modes of broadcast and gather). Each configuration is launched
+# --launches times, broadcast and gather also repeat the operation --iterations times inside each launch. The
+# first sample of a configuration (launch 1, iteration 1) is reported as cold, every other sample as warm.
+#
+# Runs inside the ClassActivities/1 image, which has bash, awk, mpicc and Open MPI, with the repository mounted:
+#
+#     docker build -t cosc420-classactivity-1 ClassActivities/1
+#     docker run --rm -v "$PWD":/app cosc420-classactivity-1 bench/run_benchmarks.sh --quick
+#
+# Options:
+#
+#     --out <dir>           Where results go (default bench/results/<date>-<time>)
+#     --ranks "<list>"      Rank counts to sweep (default "2 4 8")
+#     --launches <l>        Launches per configuration (default 3)
+#     --iterations <i>      Repetitions inside each broadcast and gather launch (default 10)
+#     --programs "<list>"   Any of ratings summation broadcast gather (default all four)
+#     --quick               Small sweep for a smoke test, explicit options and variables still apply
+#     --large               Also run --path=rma above RATINGS_RMA_MAX ratings in total, skipped by default
+#
+# The sweeps themselves can be overridden from the environment:
+#
+#     RATINGS_M, RATINGS_N  Products and ratings per product for OnlineRatings
+#     RATINGS_OPTIONS       Extra OnlineRatings options, --timing and --seed are always passed
+#     RATINGS_PATHS         OnlineRatings --path values to compare (default p2p, collective, shared and rma)
+#     RATINGS_RMA_MAX       Largest m x n run with --path=rma unless --large is given (default 10^9)
+#     SUMMATION_N           n for summation, up to 10^10
+#     SUMMATION_OPTIONS     Extra summation options such as --data=double
+#     SUMMATION_REDUCES     summation --reduce values to compare (default mpi, tree and rma)
+#     MESSAGE_BYTES         Bytes broadcast, and bytes gathered from each rank (gather skips ranks x bytes past 2^31 - 1)
+#     BROADCAST_ALGORITHMS  broadcast --algorithm values to compare (default every algorithm and MPI_Bcast)
+#     GATHER_ALGORITHMS     gather --algorithm values to compare (default every algorithm)
+#     MPIRUN                Launcher (default mpirun, with --oversubscribe and --allow-run-as-root under Open MPI)
+#     OMP_NUM_THREADS       Threads per rank, 1 unless set
+#
+# Output files in <dir>:
+#
+#     runs.csv      program,ranks,m,n,bytes,options,launch,iteration,phase,seconds, one line per sample, options
+#                   quoted as in RFC 4180 since option values such as --prior=3,10 may hold commas
+#     runs.json     {"meta": {...}, "runs": [...]} with the same fields plus the host, MPI and commit
+#     summary.csv   per configuration: cold seconds and warm count, min, mean, max and standard deviation
+#     logs/         the output of every launch, with OnlineRatings' result boxes left out
+
+set -u
+
+repo_root="$(cd "$(dirname "$0")/.." && pwd)"
+
+out_dir=""
+ranks_list=""
+launches=""
+iterations=""
+programs="ratings summation broadcast gather"
+quick=0
+large=0
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --out) out_dir="$2"; shift 2 ;;
+        --ranks) ranks_list="$2"; shift 2 ;;
+        --launches) launches="$2"; shift 2 ;;
+        --iterations) iterations="$2"; shift 2 ;;
+        --programs) programs="$2"; shift 2 ;;
+        --quick) quick=1; shift ;;
+        --large) large=1; shift ;;
+        *) echo "Unknown option: $1" >&2; exit 1 ;;
+    esac
+done
+
+if [ "$quick" -eq 1 ]; then
+    : "${RATINGS_M:=15 200}"
+    : "${RATINGS_N:=1000 100000}"
+    : "${SUMMATION_N:=1000 10000000}"
+    : "${MESSAGE_BYTES:=8 65536 4194304}"
+    : "${ranks_list:=2 4}"
+    : "${launches:=2}"
+    : "${iterations:=5}"
+fi
+: "${ranks_list:=2 4 8}"
+: "${launches:=3}"
+: "${iterations:=10}"
+: "${RATINGS_M:=15 1000 10000}"
+: "${RATINGS_N:=1000 100000 1000000}"
+: "${RATINGS_OPTIONS:=--schedule=dynamic}"
+: "${RATINGS_PATHS:=p2p collective shared rma}"
+: "${RATINGS_RMA_MAX:=1000000000}"
+: "${SUMMATION_OPTIONS:=}"
+: "${SUMMATION_REDUCES:=mpi tree rma}"
+: "${BROADCAST_ALGORITHMS:=mpi linear binomial scatter-allgather chain auto}"
+: "${GATHER_ALGORITHMS:=gather gatherv allgather-mpi recursive-doubling ring}"
+: "${SUMMATION_N:=1000 1000000 100000000 10000000000}"
+: "${MESSAGE_BYTES:=8 1024 65536 1048576 16777216 134217728 268435456}"
+: "${OMP_NUM_THREADS:=1}"
+export OMP_NUM_THREADS
+
+if [ -z "$out_dir" ]; then
+    out_dir="$repo_root/bench/results/$(date +%Y%m%d-%H%M%S)"
+fi
+mkdir -p "$out_dir/bin" "$out_dir/logs" || exit 1
+
+if [ -z "${MPIRUN:-}" ]; then
+    MPIRUN="mpirun"
+    if mpirun --version 2>&1 | grep -q "Open MPI"; then
+        MPIRUN="$MPIRUN --oversubscribe"
+        if [ "$(id -u)" -eq 0 ]; then
+            MPIRUN="$MPIRUN --allow-run-as-root"
+        fi
+    fi
+fi
+
+# Build everything from source so the results never come from stale binaries
+openmp_flag="-fopenmp"
+if ! echo "int main(void) { return 0; }" | mpicc -fopenmp -x c - -o "$out_dir/bin/openmp_check" 2>/dev/null; then
+    openmp_flag=""
+fi
+rm -f "$out_dir/bin/openmp_check"
+
+build() {
+    echo "Building $2"
+    mpicc -O2 $openmp_flag "$repo_root/$1" -o "$out_dir/bin/$2" -lm || exit 1
+}
+build HW1/SpencerPresley/OnlineRatings.c OnlineRatings
+build ClassActivities/1/code/summation.c summation
+build ClassActivities/2/broadcast.c broadcast
+build ClassActivities/2/gather.c gather
+
+csv="$out_dir/runs.csv"
+echo "program,ranks,m,n,bytes,options,launch,iteration,phase,seconds" > "$csv"
+failures=0
+
+# run <program> <ranks> <m> <n> <bytes> <options> <launch> <log> <command...>
+# Appends one CSV line per "Elapsed time" line the launch prints
+run() {
+    local program="$1" ranks="$2" m="$3" n="$4" bytes="$5" options="$6" launch="$7" log="$8"
+    shift 8
+    $MPIRUN -np "$ranks" "$@" 2>&1 | grep -v -e '═' -e '║' -e '^$' > "$log"
+    local status=${PIPESTATUS[0]}
+    if [ "$status" -ne 0 ] || ! grep -q "^Elapsed time:" "$log"; then
+        echo "  failed (exit $status), see $log" >&2
+        failures=$((failures + 1))
+        return
+    fi
+    awk -v program="$program" -v ranks="$ranks" -v m="$m" -v n="$n" -v bytes="$bytes" -v options="$options" -v launch="$launch" '
+        BEGIN { gsub(/"/, "\"\"", options) }
+        /^Elapsed time:/ {
+            iteration++
+            phase = (launch == 1 && iteration == 1) ? "cold" : "warm"
+            printf "%s,%s,%s,%s,%s,\"%s\",%s,%s,%s,%s\n", program, ranks, m, n, bytes, options, launch, iteration, phase, $3
+        }' "$log" >> "$csv"
+}
+
+# Splits a runs.csv line into field[1..10]. Only options (field 6) is quoted and may hold commas, the four
+# fields after it never do, so it is everything between the fifth and the fourth-last comma
+csv_fields='
+    function split_run(line, field,    parts, count, i) {
+        count = split(line, parts, ",")
+        for (i = 1; i <= 5; i++) field[i] = parts[i]
+        field[6] = parts[6]
+        for (i = 7; i <= count - 4; i++) field[6] = field[6] "," parts[i]
+        for (i = 7; i <= 10; i++) field[i] = parts[count - 10 + i]
+        field[6] = substr(field[6], 2, length(field[6]) - 2)
+        gsub(/""/, "\"", field[6])
+    }'
+
+has_program() {
+    case " $programs " in
+        *" $1 "*) return 0 ;;
+    esac
+    return 1
+}
+
+for ranks in $ranks_list; do
+    if has_program ratings; then
+        for m in $RATINGS_M; do
+            for n in $RATINGS_N; do
+                for path in $RATINGS_PATHS; do
+                    if [ "$path" = rma ] && [ "$large" -eq 0 ] && [ $((m * n)) -gt "$RATINGS_RMA_MAX" ]; then
+                        echo "OnlineRatings: $ranks ranks, m=$m, n=$n --path=rma skipped, above RATINGS_RMA_MAX (use --large)"
+                        continue
+                    fi
+                    echo "OnlineRatings: $ranks ranks, m=$m, n=$n --path=$path $RATINGS_OPTIONS"
+                    for launch in $(seq 1 "$launches"); do
+                        run ratings "$ranks" "$m" "$n" "" "--path=$path${RATINGS_OPTIONS:+ $RATINGS_OPTIONS}" "$launch" "$out_dir/logs/ratings_p${ranks}_m${m}_n${n}_${path}_l${launch}.log" \
+                            "$out_dir/bin/OnlineRatings" "$m" "$n" --seed=1 --timing "--path=$path" $RATINGS_OPTIONS
+                    done
+                done
+            done
+        done
+    fi
+
+    if has_program summation; then
+        for n in $SUMMATION_N; do
+            for reduce in $SUMMATION_REDUCES; do
+                echo "summation: $ranks ranks, n=$n --reduce=$reduce $SUMMATION_OPTIONS"
+                for launch in $(seq 1 "$launches"); do
+                    run summation "$ranks" "" "$n" "" "--reduce=$reduce${SUMMATION_OPTIONS:+ $SUMMATION_OPTIONS}" "$launch" "$out_dir/logs/summation_p${ranks}_n${n}_${reduce}_l${launch}.log" \
+                        "$out_dir/bin/summation" "$n" "--reduce=$reduce" $SUMMATION_OPTIONS
+                done
+            done
+        done
+    fi
+
+    if has_program broadcast; then
+        for bytes in $MESSAGE_BYTES; do
+            for algorithm in $BROADCAST_ALGORITHMS; do
+                echo "broadcast: $ranks ranks, $bytes bytes, $algorithm"
+                for launch in $(seq 1 "$launches"); do
+                    run broadcast "$ranks" "" "" "$bytes" "--algorithm=$algorithm" "$launch" "$out_dir/logs/broadcast_p${ranks}_b${bytes}_${algorithm}_l${launch}.log" \
+                        "$out_dir/bin/broadcast" "$bytes" "$iterations" "--algorithm=$algorithm"
+                done
+            done
+        done
+    fi
+
+    if has_program gather; then
+        for bytes in $MESSAGE_BYTES; do
+            # gather places every rank's block at an int displacement and refuses more than 2^31 - 1 bytes in total
+            if [ $((ranks * bytes)) -gt 2147483647 ]; then
+                echo "gather: $ranks ranks, $bytes bytes skipped, more than 2147483647 bytes in total"
+                continue
+            fi
+            for algorithm in $GATHER_ALGORITHMS; do
+                echo "gather: $ranks ranks, $bytes bytes, $algorithm"
+                for launch in $(seq 1 "$launches"); do
+                    run gather "$ranks" "" "" "$bytes" "--algorithm=$algorithm" "$launch" "$out_dir/logs/gather_p${ranks}_b${bytes}_${algorithm}_l${launch}.log" \
+                        "$out_dir/bin/gather" "$bytes" "$iterations" "--algorithm=$algorithm"
+                done
+            done
+        done
+    fi
+done
+
+# Cold time and warm statistics per configuration, in the order the configurations ran
+awk "$csv_fields"'
+    NR == 1 { next }
+    {
+        split_run($0, f)
+        options = f[6]
+        gsub(/"/, "\"\"", options)
+        key = f[1] "," f[2] "," f[3] "," f[4] "," f[5] ",\"" options "\""
+        if (!(key in seen)) {
+            seen[key] = 1
+            order[++keys] = key
+        }
+        if (f[9] == "cold") {
+            cold[key] = f[10]
+        } else {
+            count[key]++
+            sum[key] += f[10]
+            squares[key] += f[10] * f[10]
+            if (!(key in low) || f[10] < low[key]) low[key] = f[10]
+            if (!(key in high) || f[10] > high[key]) high[key] = f[10]
+        }
+    }
+    END {
+        print "program,ranks,m,n,bytes,options,cold_seconds,warm_count,warm_min,warm_mean,warm_max,warm_stddev"
+        for (i = 1; i <= keys; i++) {
+            key = order[i]
+            c = count[key] + 0
+            if (c > 0) {
+                mean = sum[key] / c
+                variance = squares[key] / c - mean * mean
+                printf "%s,%s,%d,%.9f,%.9f,%.9f,%.9f\n", key, cold[key], c, low[key], mean, high[key], sqrt(variance > 0 ? variance : 0)
+            } else {
+                printf "%s,%s,0,,,,\n", key, cold[key]
+            }
+        }
+    }' "$csv" > "$out_dir/summary.csv"
+
+# The same samples as JSON, with what is needed to reproduce them
+json_string() {
+    printf '"%s"' "$(printf '%s' "$1" | sed -e 's/\\/\\\\/g' -e 's/"/\\"/g' | tr '\n' ' ')"
+}
+commit="$(git -C "$repo_root" rev-parse HEAD 2>/dev/null || echo unknown)"
+{
+    echo "{"
+    echo "  \"meta\": {"
+    echo "    \"date\": $(json_string "$(date -u +%Y-%m-%dT%H:%M:%SZ)"),"
+    echo "    \"host\": $(json_string "$(uname -n)"),"
+    echo "    \"cpus\": $(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 0),"
+    echo "    \"mpi\": $(json_string "$(mpirun --version 2>&1 | head -n 1)"),"
+    echo "    \"mpirun\": $(json_string "$MPIRUN"),"
+    echo "    \"omp_num_threads\": $OMP_NUM_THREADS,"
+    echo "    \"commit\": $(json_string "$commit"),"
+    echo "    \"launches\": $launches,"
+    echo "    \"iterations\": $iterations"
+    echo "  },"
+    echo "  \"runs\": ["
+    awk "$csv_fields"'
+        NR == 1 { next }
+        {
+            if (printed) print ","
+            split_run($0, f)
+            gsub(/\\/, "\\\\\\\\", f[6])
+            gsub(/"/, "\\\"", f[6])
+            printf "    {\"program\": \"%s\", \"ranks\": %s, \"m\": %s, \"n\": %s, \"bytes\": %s, \"options\": \"%s\", \"launch\": %s, \"iteration\": %s, \"phase\": \"%s\", \"seconds\": %s}", \
+                f[1], f[2], (f[3] == "" ? "null" : f[3]), (f[4] == "" ? "null" : f[4]), (f[5] == "" ? "null" : f[5]), f[6], f[7], f[8], f[9], f[10]
+            printed = 1
+        }
+        END { if (printed) print "" }' "$csv"
+    echo "  ]"
+    echo "}"
+} > "$out_dir/runs.json"
+
+echo "Results in $out_dir"
+if [ "$failures" -gt 0 ]; then
+    echo "$failures launches failed" >&2
+    exit 1
+fi